@@ -0,0 +1,406 @@
+// kill, wait4 and nanosleep
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "workload.h"
+
+// Macro benchmark of the shell binary, run as is on generated workloads.
+//
+// Each workload runs twice. Once with the whole script on stdin, from a
+// file like a user would feed it, timed end to end for throughput and
+// peak RSS. Once with the binary serving a socket, commands sent one at a
+// time and each timed from sending it to the end of its response, for
+// latency per command type. Socket round trips are part of those times, so
+// they are for comparing builds rather than absolute.
+//
+// Results go to stdout as JSON, one object per line: a summary per
+// workload, then one per command type in it.
+
+#define RESPONSE_READ_SIZE (64 * 1024)
+#define CONNECT_TRIES 5000 // A millisecond apart
+
+typedef struct options {
+  const char *binary;
+  unsigned scale;
+  const char *threads; // Passed on as -t, NULL leaves the default
+} options;
+
+// Latencies of one command type, in nanoseconds
+typedef struct samples {
+  char type[16];
+  uint64_t *ns;
+  size_t count;
+  size_t capacity;
+} samples;
+
+typedef struct latencies {
+  samples *types;
+  size_t count;
+  size_t capacity;
+} latencies;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// The command name, with the flavours that behave differently told apart:
+// cp -r and rm -r, and echo > from echo >>
+static void command_type(const char *line, size_t len, char *type,
+                         size_t size) {
+  size_t n = strcspn(line, " \n");
+  if (n >= size) {
+    n = size - 1;
+  }
+  memcpy(type, line, n);
+  type[n] = '\0';
+
+  if ((strcmp(type, "cp") == 0 || strcmp(type, "rm") == 0) &&
+      strncmp(line + n, " -r ", 4) == 0) {
+    strcat(type, " -r");
+  } else if (strcmp(type, "echo") == 0) {
+    // The redirection follows the closing quote
+    const char *quote = NULL;
+    for (const char *p = line; p < line + len; p++) {
+      if (*p == '"') {
+        quote = p;
+      }
+    }
+    if (quote != NULL && strncmp(quote, "\" >>", 4) == 0) {
+      strcat(type, " >>");
+    } else {
+      strcat(type, " >");
+    }
+  }
+}
+
+static void record(latencies *l, const char *type, uint64_t ns) {
+  samples *s = NULL;
+  for (size_t i = 0; i < l->count; i++) {
+    if (strcmp(l->types[i].type, type) == 0) {
+      s = &l->types[i];
+      break;
+    }
+  }
+  if (s == NULL) {
+    if (l->count == l->capacity) {
+      l->capacity = l->capacity == 0 ? 16 : l->capacity * 2;
+      l->types = realloc(l->types, l->capacity * sizeof(samples));
+      if (l->types == NULL) {
+        exit(ENOMEM);
+      }
+    }
+    s = &l->types[l->count++];
+    *s = (samples){0};
+    strcpy(s->type, type);
+  }
+
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity == 0 ? 1024 : s->capacity * 2;
+    s->ns = realloc(s->ns, s->capacity * sizeof(uint64_t));
+    if (s->ns == NULL) {
+      exit(ENOMEM);
+    }
+  }
+  s->ns[s->count++] = ns;
+}
+
+static void free_latencies(latencies *l) {
+  for (size_t i = 0; i < l->count; i++) {
+    free(l->types[i].ns);
+  }
+  free(l->types);
+  *l = (latencies){0};
+}
+
+static int compare_ns(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Start the binary with the given extra arguments, stdin from in_fd if it
+// is not -1, stdout thrown away
+static pid_t spawn(const options *opts, const char *flag, const char *value,
+                   int in_fd) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+
+  if (in_fd != -1) {
+    dup2(in_fd, STDIN_FILENO);
+    close(in_fd);
+  }
+  FILE *null = fopen("/dev/null", "w");
+  if (null != NULL) {
+    dup2(fileno(null), STDOUT_FILENO);
+  }
+
+  const char *argv[8];
+  int argc = 0;
+  argv[argc++] = opts->binary;
+  if (opts->threads != NULL) {
+    argv[argc++] = "-t";
+    argv[argc++] = opts->threads;
+  }
+  if (flag != NULL) {
+    argv[argc++] = flag;
+    argv[argc++] = value;
+  }
+  argv[argc] = NULL;
+  execv(opts->binary, (char *const *)argv);
+  fprintf(stderr, "bench: %s: %s\n", opts->binary, strerror(errno));
+  _exit(127);
+}
+
+// Run the whole script from a file on stdin. The file is unlinked right
+// away, the shell maps it like any other.
+static int run_throughput(const options *opts, const script *s,
+                          double *seconds, long *peak_rss_kb) {
+  char path[] = "/tmp/fs-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    return errno;
+  }
+  unlink(path);
+  size_t done = 0;
+  while (done < s->len) {
+    ssize_t n = write(fd, s->data + done, s->len - done);
+    if (n < 0) {
+      int err = errno;
+      close(fd);
+      return err;
+    }
+    done += (size_t)n;
+  }
+  if (write(fd, "exit\n", 5) != 5 || lseek(fd, 0, SEEK_SET) != 0) {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+
+  uint64_t start = now_ns();
+  pid_t pid = spawn(opts, NULL, NULL, fd);
+  close(fd);
+  if (pid < 0) {
+    return errno;
+  }
+  int status = 0;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    return errno;
+  }
+  *seconds = (double)(now_ns() - start) / 1e9;
+  *peak_rss_kb = usage.ru_maxrss;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "bench: %s exited with status %d\n", opts->binary,
+            WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return ECHILD;
+  }
+  return 0;
+}
+
+static int connect_to(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  for (int i = 0; i < CONNECT_TRIES; i++) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+    close(fd);
+    struct timespec pause = {0, 1000000};
+    nanosleep(&pause, NULL);
+  }
+  return -1;
+}
+
+// Send one line and wait for the NUL that ends its response
+static int round_trip(int fd, const char *line, size_t len, char *buffer) {
+  while (len > 0) {
+    ssize_t n = send(fd, line, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno;
+    }
+    line += n;
+    len -= (size_t)n;
+  }
+  for (;;) {
+    ssize_t n = recv(fd, buffer, RESPONSE_READ_SIZE, 0);
+    if (n <= 0) {
+      return n == 0 ? ECONNRESET : errno;
+    }
+    if (memchr(buffer, '\0', (size_t)n) != NULL) {
+      return 0;
+    }
+  }
+}
+
+// Run the script through a server, one command in flight at a time
+static int run_latency(const options *opts, const script *s, latencies *l,
+                       long *peak_rss_kb) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/fs-bench-%d.sock", (int)getpid());
+  unlink(path);
+
+  pid_t pid = spawn(opts, "-s", path, -1);
+  if (pid < 0) {
+    return errno;
+  }
+  int fd = connect_to(path);
+  int err = fd == -1 ? ECONNREFUSED : 0;
+
+  char *buffer = malloc(RESPONSE_READ_SIZE);
+  if (buffer == NULL) {
+    exit(ENOMEM);
+  }
+  char type[16];
+  for (size_t at = 0; err == 0 && at < s->len;) {
+    const char *line = s->data + at;
+    size_t len = (size_t)((char *)memchr(line, '\n', s->len - at) - line) + 1;
+    command_type(line, len, type, sizeof(type));
+
+    uint64_t start = now_ns();
+    err = round_trip(fd, line, len, buffer);
+    record(l, type, now_ns() - start);
+    at += len;
+  }
+  free(buffer);
+  if (fd != -1) {
+    close(fd);
+  }
+
+  kill(pid, SIGTERM);
+  struct rusage usage;
+  int status = 0;
+  if (wait4(pid, &status, 0, &usage) < 0 && err == 0) {
+    err = errno;
+  }
+  *peak_rss_kb = usage.ru_maxrss;
+  unlink(path);
+  return err;
+}
+
+static void report(const workload *w, const options *opts, const script *s,
+                   double seconds, long rss_kb, long server_rss_kb,
+                   latencies *l) {
+  printf("{\"workload\":\"%s\",\"scale\":%u,\"threads\":%s,\"commands\":%zu,"
+         "\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"peak_rss_kb\":%ld,"
+         "\"server_peak_rss_kb\":%ld}\n",
+         w->name, opts->scale, opts->threads == NULL ? "0" : opts->threads,
+         s->count, seconds, (double)s->count / seconds, rss_kb,
+         server_rss_kb);
+
+  for (size_t i = 0; i < l->count; i++) {
+    samples *t = &l->types[i];
+    qsort(t->ns, t->count, sizeof(uint64_t), compare_ns);
+    uint64_t total = 0;
+    for (size_t j = 0; j < t->count; j++) {
+      total += t->ns[j];
+    }
+    printf("{\"workload\":\"%s\",\"command\":\"%s\",\"count\":%zu,"
+           "\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,"
+           "\"max_us\":%.2f}\n",
+           w->name, t->type, t->count, (double)total / t->count / 1e3,
+           t->ns[(t->count - 1) * 50 / 100] / 1e3,
+           t->ns[(t->count - 1) * 99 / 100] / 1e3,
+           t->ns[t->count - 1] / 1e3);
+  }
+  fflush(stdout);
+}
+
+static int run_workload(const workload *w, const options *opts) {
+  script s = {0};
+  w->generate(&s, opts->scale);
+
+  double seconds = 0;
+  long rss_kb = 0;
+  long server_rss_kb = 0;
+  latencies l = {0};
+  int err = run_throughput(opts, &s, &seconds, &rss_kb);
+  if (err == 0) {
+    err = run_latency(opts, &s, &l, &server_rss_kb);
+  }
+  if (err == 0) {
+    report(w, opts, &s, seconds, rss_kb, server_rss_kb, &l);
+  } else {
+    fprintf(stderr, "bench: %s: %s\n", w->name, strerror(err));
+  }
+
+  free_latencies(&l);
+  script_free(&s);
+  return err;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-b binary] [-s scale] [-t threads] [workload...]\n"
+          "workloads:\n",
+          name);
+  for (size_t i = 0; i < workload_count; i++) {
+    fprintf(stderr, "  %-8s %s\n", workloads[i].name,
+            workloads[i].description);
+  }
+}
+
+int main(int argc, char **argv) {
+  options opts = {"./main", 1, NULL};
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "b:s:t:")) != -1) {
+    if (opt == 'b') {
+      opts.binary = optarg;
+    } else if (opt == 's') {
+      opts.scale = (unsigned)strtoul(optarg, NULL, 10);
+    } else if (opt == 't') {
+      opts.threads = optarg;
+    } else {
+      usage(argv[0]);
+      return EINVAL;
+    }
+  }
+  if (opts.scale == 0) {
+    usage(argv[0]);
+    return EINVAL;
+  }
+
+  // Check the names before spending minutes on the first ones
+  for (int i = optind; i < argc; i++) {
+    if (find_workload(argv[i]) == NULL) {
+      fprintf(stderr, "%s: unknown workload %s\n", argv[0], argv[i]);
+      usage(argv[0]);
+      return EINVAL;
+    }
+  }
+
+  int failed = 0;
+  if (optind == argc) {
+    for (size_t i = 0; i < workload_count; i++) {
+      failed |= run_workload(&workloads[i], &opts);
+    }
+  } else {
+    for (int i = optind; i < argc; i++) {
+      failed |= run_workload(find_workload(argv[i]), &opts);
+    }
+  }
+  return failed != 0;
+}
@@ -0,0 +1,539 @@
+// vasprintf
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "dir.h"
+#include "epoch.h"
+#include "fs.h"
+#include "lz.h"
+#include "util.h"
+
+// Micro benchmarks of the primitives commands are built from, each on an
+// instance of its own set up beforehand.
+//
+// A benchmark is run in batches. The batch size is doubled until a batch
+// takes the sample time, a few batches are thrown away to warm caches and
+// the allocator up, then the time per operation of each of the remaining
+// ones makes a sample. Results go to stdout as JSON, one object per line,
+// like bench.
+
+#define MAX_NAMES 65536 // Batches that need a fresh name per operation
+#define COLD_PATHS 8192 // Twice the dcache, so every lookup misses
+
+typedef struct micro_options {
+  unsigned repetitions;
+  unsigned warmup;
+  uint64_t sample_ns;
+} micro_options;
+
+typedef struct micro {
+  const char *name;
+  size_t param; // Depth or size, 0 where it means nothing
+  void *(*setup)(size_t param);
+  // Run iterations operations, return the nanoseconds they took. Whatever
+  // has to happen between operations is left out of the time.
+  uint64_t (*run)(void *state, size_t iterations);
+  void (*teardown)(void *state);
+  size_t max_iterations; // 0 for no limit
+} micro;
+
+// What most benchmarks work on: a tree, some paths and names into it
+typedef struct bench_state {
+  _fs fs;
+  size_t param;
+  char **paths;
+  size_t path_count;
+  inode *dir;
+  inode *target;
+  DIR_ENTRY *entries; // Sort input, and the copy that gets sorted
+  DIR_ENTRY *work;
+} bench_state;
+
+// The result of every benchmarked call ends up here, so none of them can be
+// optimized away
+static volatile uintptr_t sink;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static char *format(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  char *str = NULL;
+  if (vasprintf(&str, format, args) < 0) {
+    exit(ENOMEM);
+  }
+  va_end(args);
+  return str;
+}
+
+static bench_state *new_state(size_t param) {
+  bench_state *s = calloc(1, sizeof(bench_state));
+  if (s == NULL) {
+    exit(ENOMEM);
+  }
+  init_fs(&s->fs);
+  s->param = param;
+  return s;
+}
+
+static void add_path(bench_state *s, char *path) {
+  if (s->path_count % 1024 == 0) {
+    s->paths = realloc(s->paths, (s->path_count + 1024) * sizeof(char *));
+    if (s->paths == NULL) {
+      exit(ENOMEM);
+    }
+  }
+  s->paths[s->path_count++] = path;
+}
+
+static void free_state(void *arg) {
+  bench_state *s = arg;
+  for (size_t i = 0; i < s->path_count; i++) {
+    free(s->paths[i]);
+  }
+  free(s->paths);
+  free(s->entries);
+  free(s->work);
+  clear_fs(&s->fs);
+  free(s);
+}
+
+// /d/d/.../d, param deep, with COLD_PATHS files at the bottom. paths holds
+// the absolute path of each.
+static void *setup_deep(size_t depth) {
+  bench_state *s = new_state(depth);
+  char *dir = malloc(depth * 2 + 2);
+  if (dir == NULL) {
+    exit(ENOMEM);
+  }
+  for (size_t i = 0; i < depth; i++) {
+    memcpy(dir + i * 2, "/d", 2);
+  }
+  dir[depth * 2] = '\0';
+  create_dir(&s->fs, dir);
+
+  for (size_t i = 0; i < COLD_PATHS; i++) {
+    char *path = format("%s/f%zu", dir, i);
+    create_file(&s->fs, path);
+    add_path(s, path);
+  }
+  free(dir);
+  return s;
+}
+
+// One directory, /w, with param files in it. paths holds their names, then
+// as many names that are not there.
+static void *setup_wide(size_t size) {
+  bench_state *s = new_state(size);
+  create_dir(&s->fs, "/w");
+  create_file(&s->fs, "/target");
+  resolve_path(&s->fs, "/w", &s->dir);
+  resolve_path(&s->fs, "/target", &s->target);
+
+  for (size_t i = 0; i < size; i++) {
+    // Distinct, multiplying by an odd constant is a bijection on 32 bits
+    char *path = format("/w/f%08x", (uint32_t)i * 2654435761u);
+    create_file(&s->fs, path);
+    add_path(s, format("%s", filename(path)));
+    free(path);
+  }
+  for (size_t i = 0; i < MAX_NAMES; i++) {
+    add_path(s, format("x%zu", i));
+  }
+  return s;
+}
+
+static uint64_t run_resolve_cached(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  inode *result = NULL;
+  epoch_enter();
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    resolve_path(&s->fs, s->paths[0], &result);
+  }
+  uint64_t elapsed = now_ns() - start;
+  epoch_exit();
+  sink = (uintptr_t)result;
+  return elapsed;
+}
+
+static uint64_t run_resolve_cold(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  inode *result = NULL;
+  epoch_enter();
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    resolve_path(&s->fs, s->paths[i % COLD_PATHS], &result);
+  }
+  uint64_t elapsed = now_ns() - start;
+  epoch_exit();
+  sink = (uintptr_t)result;
+  return elapsed;
+}
+
+// Names in the directory, in the order they were created
+static uint64_t run_exists_hit(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  int found = 0;
+  epoch_enter();
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    found += entry_exists(s->dir, s->paths[i % s->param]);
+  }
+  uint64_t elapsed = now_ns() - start;
+  epoch_exit();
+  sink = (uintptr_t)found;
+  return elapsed;
+}
+
+static uint64_t run_exists_miss(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  int found = 0;
+  epoch_enter();
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    found += entry_exists(s->dir, s->paths[s->param + i % MAX_NAMES]);
+  }
+  uint64_t elapsed = now_ns() - start;
+  epoch_exit();
+  sink = (uintptr_t)found;
+  return elapsed;
+}
+
+// Each section is one command's worth, like in the shell
+static void add_names(bench_state *s, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    epoch_enter();
+    add_entry(&s->fs, "/w", s->paths[s->param + i], s->target);
+    epoch_exit();
+  }
+}
+
+static void remove_names(bench_state *s, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    epoch_enter();
+    remove_entry(&s->fs, "/w", s->paths[s->param + i]);
+    epoch_exit();
+  }
+}
+
+static uint64_t run_add_entry(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  uint64_t start = now_ns();
+  add_names(s, iterations);
+  uint64_t elapsed = now_ns() - start;
+  remove_names(s, iterations);
+  return elapsed;
+}
+
+static uint64_t run_remove_entry(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  add_names(s, iterations);
+  uint64_t start = now_ns();
+  remove_names(s, iterations);
+  return now_ns() - start;
+}
+
+static void *setup_paths(size_t depth) {
+  bench_state *s = new_state(depth);
+  char *path = malloc(depth * 4 + 16);
+  if (path == NULL) {
+    exit(ENOMEM);
+  }
+  size_t len = 0;
+  for (size_t i = 0; i < depth; i++) {
+    len += (size_t)sprintf(path + len, "/d%zu", i % 10);
+  }
+  strcpy(path + len, "/file");
+  add_path(s, path);
+  return s;
+}
+
+static uint64_t run_path_parent(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    sink = path_parent(path_of(s->paths[0])).len;
+  }
+  return now_ns() - start;
+}
+
+static uint64_t run_filename(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    sink = (uintptr_t)filename(s->paths[0]);
+  }
+  return now_ns() - start;
+}
+
+static uint64_t run_path_next(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    path_view rest = path_of(s->paths[0]);
+    path_view component;
+    while (path_next(&rest, &component)) {
+      sink += component.len;
+    }
+  }
+  return now_ns() - start;
+}
+
+// A file param bytes are appended to at a time, emptied before each batch
+static void *setup_file(size_t size) {
+  bench_state *s = new_state(size);
+  create_file(&s->fs, "/log");
+  char *data = malloc(size + 1);
+  if (data == NULL) {
+    exit(ENOMEM);
+  }
+  memset(data, 'x', size);
+  data[size] = '\0';
+  add_path(s, data);
+  return s;
+}
+
+static uint64_t run_append_file(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  epoch_enter();
+  write_file(&s->fs, "/log", "", 0);
+  epoch_exit();
+
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    epoch_enter();
+    append_file(&s->fs, "/log", s->paths[0], s->param);
+    epoch_exit();
+  }
+  return now_ns() - start;
+}
+
+static uint64_t run_dedup_hash(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    sink += dedup_hash(s->paths[0], s->param);
+  }
+  return now_ns() - start;
+}
+
+// param bytes of log lines, paths[0], and their compressed form, paths[1]
+static void *setup_text(size_t size) {
+  bench_state *s = new_state(size);
+  char *text = malloc(size + 64);
+  char *packed = malloc(size);
+  if (text == NULL || packed == NULL) {
+    exit(ENOMEM);
+  }
+  size_t len = 0;
+  for (unsigned line = 0; len < size; line++) {
+    len += (size_t)sprintf(text + len, "%u GET /static/%u.css 200 %u\n",
+                           line, rand() % 64, rand() % 100000);
+  }
+  add_path(s, text);
+  add_path(s, packed);
+  if (lz_compress(text, size, packed, size) == 0) {
+    exit(EINVAL);
+  }
+  return s;
+}
+
+static uint64_t run_lz_compress(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    sink += lz_compress(s->paths[0], s->param, s->paths[1], s->param);
+  }
+  return now_ns() - start;
+}
+
+static uint64_t run_lz_decompress(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  size_t len = lz_compress(s->paths[0], s->param, s->paths[1], s->param);
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < iterations; i++) {
+    sink += (uintptr_t)lz_decompress(s->paths[1], len, s->paths[0], s->param);
+  }
+  return now_ns() - start;
+}
+
+// param entries with distinct names in random order, the first two being .
+// and .. like in a directory
+static void *setup_sort(size_t count) {
+  bench_state *s = new_state(count);
+  s->entries = calloc(count, sizeof(DIR_ENTRY));
+  s->work = malloc(count * sizeof(DIR_ENTRY));
+  if (s->entries == NULL || s->work == NULL) {
+    exit(ENOMEM);
+  }
+  uint64_t state = 88172645463325252ull;
+  for (size_t i = 0; i < count; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    snprintf(s->entries[i].name, sizeof(s->entries[i].name), "file_%016llx",
+             (unsigned long long)state);
+  }
+  return s;
+}
+
+static uint64_t run_sort(void *arg, size_t iterations) {
+  bench_state *s = arg;
+  uint64_t elapsed = 0;
+  for (size_t i = 0; i < iterations; i++) {
+    memcpy(s->work, s->entries, s->param * sizeof(DIR_ENTRY));
+    uint64_t start = now_ns();
+    qsort(s->work, s->param, sizeof(DIR_ENTRY), compare_entries);
+    elapsed += now_ns() - start;
+  }
+  sink = (uintptr_t)s->work[0].name[0];
+  return elapsed;
+}
+
+static const micro micros[] = {
+    {"resolve_path/cached", 1, setup_deep, run_resolve_cached, free_state, 0},
+    {"resolve_path/cached", 64, setup_deep, run_resolve_cached, free_state, 0},
+    {"resolve_path/cold", 1, setup_deep, run_resolve_cold, free_state, 0},
+    {"resolve_path/cold", 8, setup_deep, run_resolve_cold, free_state, 0},
+    {"resolve_path/cold", 64, setup_deep, run_resolve_cold, free_state, 0},
+    {"resolve_path/cold", 512, setup_deep, run_resolve_cold, free_state, 0},
+    {"entry_exists/hit", 16, setup_wide, run_exists_hit, free_state, 0},
+    {"entry_exists/hit", 1024, setup_wide, run_exists_hit, free_state, 0},
+    {"entry_exists/hit", 65536, setup_wide, run_exists_hit, free_state, 0},
+    {"entry_exists/miss", 16, setup_wide, run_exists_miss, free_state, 0},
+    {"entry_exists/miss", 65536, setup_wide, run_exists_miss, free_state, 0},
+    {"add_entry", 16, setup_wide, run_add_entry, free_state, MAX_NAMES},
+    {"add_entry", 65536, setup_wide, run_add_entry, free_state, MAX_NAMES},
+    {"remove_entry", 16, setup_wide, run_remove_entry, free_state, MAX_NAMES},
+    {"remove_entry", 65536, setup_wide, run_remove_entry, free_state,
+     MAX_NAMES},
+    {"path_parent", 4, setup_paths, run_path_parent, free_state, 0},
+    {"path_parent", 64, setup_paths, run_path_parent, free_state, 0},
+    {"filename", 4, setup_paths, run_filename, free_state, 0},
+    {"filename", 64, setup_paths, run_filename, free_state, 0},
+    {"path_next", 4, setup_paths, run_path_next, free_state, 0},
+    {"path_next", 64, setup_paths, run_path_next, free_state, 0},
+    {"append_file", 16, setup_file, run_append_file, free_state, 0},
+    {"append_file", 4096, setup_file, run_append_file, free_state, 0},
+    {"dedup_hash", 64, setup_file, run_dedup_hash, free_state, 0},
+    {"dedup_hash", 4096, setup_file, run_dedup_hash, free_state, 0},
+    {"lz_compress", 65536, setup_text, run_lz_compress, free_state, 0},
+    {"lz_decompress", 65536, setup_text, run_lz_decompress, free_state, 0},
+    {"compare_entries/qsort", 1024, setup_sort, run_sort, free_state, 0},
+    {"compare_entries/qsort", 65536, setup_sort, run_sort, free_state, 0},
+};
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void measure(const micro *m, const micro_options *opts) {
+  void *state = m->setup(m->param);
+
+  // Big enough batches that the clock and whatever runs between them do not
+  // count
+  size_t iterations = 1;
+  while (m->run(state, iterations) < opts->sample_ns &&
+         (m->max_iterations == 0 || iterations * 2 <= m->max_iterations)) {
+    iterations *= 2;
+  }
+  for (unsigned i = 0; i < opts->warmup; i++) {
+    m->run(state, iterations);
+  }
+
+  double *samples = malloc(opts->repetitions * sizeof(double));
+  if (samples == NULL) {
+    exit(ENOMEM);
+  }
+  double total = 0;
+  for (unsigned i = 0; i < opts->repetitions; i++) {
+    samples[i] = (double)m->run(state, iterations) / (double)iterations;
+    total += samples[i];
+  }
+  m->teardown(state);
+
+  double mean = total / opts->repetitions;
+  double variance = 0;
+  for (unsigned i = 0; i < opts->repetitions; i++) {
+    variance += (samples[i] - mean) * (samples[i] - mean);
+  }
+  variance /= opts->repetitions > 1 ? opts->repetitions - 1 : 1;
+  qsort(samples, opts->repetitions, sizeof(double), compare_doubles);
+
+  printf("{\"benchmark\":\"%s\",\"param\":%zu,\"iterations\":%zu,"
+         "\"samples\":%u,\"median_ns\":%.2f,\"min_ns\":%.2f,"
+         "\"mean_ns\":%.2f,\"stddev_ns\":%.2f}\n",
+         m->name, m->param, iterations, opts->repetitions,
+         samples[opts->repetitions / 2], samples[0], mean, sqrt(variance));
+  fflush(stdout);
+  free(samples);
+}
+
+// A benchmark runs if its name, or its name and parameter as in
+// resolve_path/cold/64, starts with one of the filters
+static bool selected(const micro *m, char **filters, int count) {
+  if (count == 0) {
+    return true;
+  }
+  char full[64];
+  snprintf(full, sizeof(full), "%s/%zu", m->name, m->param);
+  for (int i = 0; i < count; i++) {
+    if (strncmp(full, filters[i], strlen(filters[i])) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  micro_options opts = {15, 3, 10000000};
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "r:w:m:l")) != -1) {
+    if (opt == 'r') {
+      opts.repetitions = (unsigned)strtoul(optarg, NULL, 10);
+    } else if (opt == 'w') {
+      opts.warmup = (unsigned)strtoul(optarg, NULL, 10);
+    } else if (opt == 'm') {
+      opts.sample_ns = strtoull(optarg, NULL, 10) * 1000000;
+    } else if (opt == 'l') {
+      for (size_t i = 0; i < sizeof(micros) / sizeof(micros[0]); i++) {
+        printf("%s/%zu\n", micros[i].name, micros[i].param);
+      }
+      return 0;
+    } else {
+      fprintf(stderr,
+              "usage: %s [-r repetitions] [-w warmup] [-m sample_ms] [-l] "
+              "[benchmark...]\n",
+              argv[0]);
+      return EINVAL;
+    }
+  }
+  if (opts.repetitions == 0) {
+    opts.repetitions = 1;
+  }
+
+  for (size_t i = 0; i < sizeof(micros) / sizeof(micros[0]); i++) {
+    if (selected(&micros[i], argv + optind, argc - optind)) {
+      measure(&micros[i], &opts);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workload.h"
+
+// Append one command, a newline is added
+static void emit(script *s, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  va_list again;
+  va_copy(again, args);
+  int len = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+
+  if (s->len + (size_t)len + 2 > s->capacity) {
+    size_t capacity = s->capacity == 0 ? 4096 : s->capacity;
+    while (s->len + (size_t)len + 2 > capacity) {
+      capacity *= 2;
+    }
+    char *data = realloc(s->data, capacity);
+    if (data == NULL) {
+      exit(ENOMEM);
+    }
+    s->data = data;
+    s->capacity = capacity;
+  }
+  vsnprintf(s->data + s->len, (size_t)len + 1, format, again);
+  va_end(again);
+  s->len += (size_t)len;
+  s->data[s->len++] = '\n';
+  s->count++;
+}
+
+// xorshift64*, every workload starts from the same seed so runs compare
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ull;
+}
+
+static uint32_t pick(uint64_t *state, uint32_t n) {
+  return (uint32_t)(next_random(state) % n);
+}
+
+// Unique names in no particular order, multiplying by an odd constant is a
+// bijection on 32 bits
+static uint32_t scramble(uint32_t i) { return i * 2654435761u; }
+
+// Directories fanout wide and depth deep under root, files files each
+static void build_tree(script *s, char *path, size_t len, unsigned fanout,
+                       unsigned depth, unsigned files) {
+  emit(s, "mkdir %s", path);
+  for (unsigned i = 0; i < files; i++) {
+    emit(s, "echo \"contents of %s/f%u\" > %s/f%u", path, i, path, i);
+  }
+  if (depth == 0) {
+    return;
+  }
+  for (unsigned i = 0; i < fanout; i++) {
+    int n = sprintf(path + len, "/d%u", i);
+    build_tree(s, path, len + (size_t)n, fanout, depth - 1, files);
+    path[len] = '\0';
+  }
+}
+
+// One directory with a hundred thousand entries, created, looked up, written
+// and emptied again
+static void generate_wide(script *s, unsigned scale) {
+  uint32_t n = 100000 * scale;
+  uint64_t state = 1;
+
+  emit(s, "mkdir /wide");
+  for (uint32_t i = 0; i < n; i++) {
+    emit(s, "touch /wide/f%08x", scramble(i));
+  }
+  for (int i = 0; i < 4; i++) {
+    emit(s, "ls /wide");
+  }
+  for (uint32_t i = 0; i < n / 10; i++) {
+    emit(s, "cat /wide/f%08x", scramble(pick(&state, n)));
+    emit(s, "echo \"%u\" > /wide/f%08x", i, scramble(pick(&state, n)));
+  }
+  for (uint32_t i = 0; i < n / 2; i++) {
+    emit(s, "rm /wide/f%08x", scramble(i));
+  }
+  emit(s, "rm -r /wide");
+}
+
+// A chain of a thousand directories, files worked on at random depths
+// through absolute paths
+static void generate_deep(script *s, unsigned scale) {
+  uint32_t depth = 1000 * scale;
+  uint64_t state = 2;
+
+  emit(s, "mkdir /deep");
+  emit(s, "cd /deep");
+  for (uint32_t i = 0; i < depth; i++) {
+    emit(s, "mkdir d");
+    emit(s, "cd d");
+  }
+  emit(s, "cd /");
+
+  char *path = malloc(6 + depth * 2 + 1);
+  if (path == NULL) {
+    exit(ENOMEM);
+  }
+  for (uint32_t i = 0; i < 2000 * scale; i++) {
+    uint32_t level = 1 + pick(&state, depth);
+    size_t len = (size_t)sprintf(path, "/deep");
+    for (uint32_t j = 0; j < level; j++) {
+      memcpy(path + len, "/d", 2);
+      len += 2;
+    }
+    path[len] = '\0';
+    emit(s, "touch %s/f%u", path, i);
+    emit(s, "echo \"at %u\" > %s/f%u", level, path, i);
+    emit(s, "cat %s/f%u", path, i);
+    emit(s, "ls %s", path);
+  }
+  free(path);
+  emit(s, "rm -r /deep");
+}
+
+// Log files growing one line at a time
+static void generate_append(script *s, unsigned scale) {
+  uint32_t n = 200000 * scale;
+  uint64_t state = 3;
+
+  emit(s, "mkdir /log");
+  for (uint32_t i = 0; i < n; i++) {
+    emit(s, "echo \"%08u request served in %u us\" >> /log/l%u", i,
+         pick(&state, 100000), pick(&state, 16));
+  }
+  for (uint32_t i = 0; i < 16; i++) {
+    emit(s, "cat /log/l%u", i);
+  }
+  emit(s, "rm -r /log");
+}
+
+// Copies of a few thousand node tree
+static void generate_cptree(script *s, unsigned scale) {
+  char path[256] = "/src";
+  build_tree(s, path, strlen(path), 6, 4, 3);
+  for (unsigned i = 0; i < 4 * scale; i++) {
+    emit(s, "cp -r /src /copy%u", i);
+    emit(s, "cat /copy%u/d1/d2/d3/d4/f2", i);
+  }
+  emit(s, "find");
+}
+
+// Trees built and torn down whole
+static void generate_rmtree(script *s, unsigned scale) {
+  char path[256];
+  for (unsigned i = 0; i < 8 * scale; i++) {
+    sprintf(path, "/t%u", i);
+    build_tree(s, path, strlen(path), 5, 4, 2);
+  }
+  for (unsigned i = 0; i < 8 * scale; i++) {
+    emit(s, "rm -r /t%u", i);
+  }
+}
+
+typedef struct file_name {
+  uint32_t dir;
+  uint32_t id;
+} file_name;
+
+// Reads and writes of every kind over a tree of a few hundred files, in the
+// proportions a busy interactive user might have
+static void generate_mixed(script *s, unsigned scale) {
+  uint32_t dirs = 32;
+  uint32_t ops = 100000 * scale;
+  uint64_t state = 4;
+
+  // Live files, removed ones are swapped with the last
+  size_t capacity = dirs * 20 + ops;
+  file_name *files = malloc(capacity * sizeof(file_name));
+  if (files == NULL) {
+    exit(ENOMEM);
+  }
+  size_t count = 0;
+  uint32_t next_id = 0;
+
+  for (uint32_t d = 0; d < dirs; d++) {
+    emit(s, "mkdir /m/d%u", d);
+    for (uint32_t i = 0; i < 20; i++) {
+      files[count++] = (file_name){d, next_id};
+      emit(s, "echo \"file %u\" > /m/d%u/f%u", next_id, d, next_id);
+      next_id++;
+    }
+  }
+
+  for (uint32_t i = 0; i < ops; i++) {
+    uint32_t roll = pick(&state, 100);
+    size_t at = pick(&state, (uint32_t)count);
+    file_name f = files[at];
+    if (roll < 40) {
+      emit(s, "cat /m/d%u/f%u", f.dir, f.id);
+    } else if (roll < 50) {
+      emit(s, "ls /m/d%u", pick(&state, dirs));
+    } else if (roll < 60) {
+      emit(s, "echo \"rewritten %u\" > /m/d%u/f%u", i, f.dir, f.id);
+    } else if (roll < 70) {
+      emit(s, "echo \"line %u\" >> /m/d%u/f%u", i, f.dir, f.id);
+    } else if (roll < 78) {
+      file_name g = {pick(&state, dirs), next_id++};
+      emit(s, "touch /m/d%u/f%u", g.dir, g.id);
+      files[count++] = g;
+    } else if (roll < 85) {
+      file_name g = {pick(&state, dirs), next_id++};
+      emit(s, "cp /m/d%u/f%u /m/d%u/f%u", f.dir, f.id, g.dir, g.id);
+      files[count++] = g;
+    } else if (roll < 90) {
+      file_name g = {pick(&state, dirs), next_id++};
+      emit(s, "mv /m/d%u/f%u /m/d%u/f%u", f.dir, f.id, g.dir, g.id);
+      files[at] = g;
+    } else if (roll < 95 && count > 100) {
+      emit(s, "rm /m/d%u/f%u", f.dir, f.id);
+      files[at] = files[--count];
+    } else {
+      emit(s, "ls /m");
+    }
+  }
+  free(files);
+}
+
+const workload workloads[] = {
+    {"wide", "100k entries in one directory", generate_wide},
+    {"deep", "paths 1000 directories deep", generate_deep},
+    {"append", "echo >> to a few growing logs", generate_append},
+    {"cptree", "cp -r of a 1.5k directory tree", generate_cptree},
+    {"rmtree", "rm -r of whole trees", generate_rmtree},
+    {"mixed", "random reads and writes over a small tree", generate_mixed},
+};
+const size_t workload_count = sizeof(workloads) / sizeof(workloads[0]);
+
+const workload *find_workload(const char *name) {
+  for (size_t i = 0; i < workload_count; i++) {
+    if (strcmp(workloads[i].name, name) == 0) {
+      return &workloads[i];
+    }
+  }
+  return NULL;
+}
+
+void script_free(script *s) {
+  free(s->data);
+  *s = (script){0};
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+// Synthetic command streams for the shell, one command per line. Every
+// command in them succeeds: the shell gives up on the first one that fails,
+// so generators keep track of what exists.
+
+typedef struct script {
+  char *data;
+  size_t len;
+  size_t capacity;
+  size_t count; // Number of lines
+} script;
+
+typedef struct workload {
+  const char *name;
+  const char *description;
+  // scale 1 is sized to run in about a second, larger ones grow linearly
+  void (*generate)(script *s, unsigned scale);
+} workload;
+
+extern const workload workloads[];
+extern const size_t workload_count;
+
+const workload *find_workload(const char *name);
+void script_free(script *s);
@@ -0,0 +1,86 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "fs.h"
+
+// Every thread keeps its own, entries are only trusted once their result is
+// locked and they are checked again
+static _Thread_local dcache_entry dcache[DCACHE_SIZE];
+
+// FNV-1a over the path, seeded with the starting directory
+static uint32_t hash_key(const inode *start, const char *path,
+                         size_t path_len) {
+  uint32_t hash = 2166136261u ^ (uint32_t)((uintptr_t)start >> 4);
+  for (size_t i = 0; i < path_len; i++) {
+    hash ^= (uint8_t)path[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+const dcache_entry *dcache_lookup(_fs *fs, inode *start, const char *path,
+                                  size_t path_len) {
+  uint32_t hash = hash_key(start, path, path_len);
+  dcache_entry *entry = &dcache[hash & (DCACHE_SIZE - 1)];
+
+  if (entry->path == NULL || entry->hash != hash || entry->start != start ||
+      entry->path_len != path_len ||
+      memcmp(entry->path, path, path_len) != 0 || !dcache_valid(fs, entry)) {
+    return NULL;
+  }
+  return entry;
+}
+
+bool dcache_valid(_fs *fs, const dcache_entry *entry) {
+  // Any removal may have freed an inode the entry points to, so this has to
+  // be checked before anything else is dereferenced. Another instance, even
+  // one since torn down and replaced at the same address, has other ids.
+  if (entry->fs_id != fs->id ||
+      entry->removals != __atomic_load_n(&fs->removals, __ATOMIC_SEQ_CST)) {
+    return false;
+  }
+
+  return entry->err != ENOENT ||
+         __atomic_load_n(&entry->miss_dir->generation, __ATOMIC_ACQUIRE) ==
+             entry->miss_generation;
+}
+
+void dcache_insert(_fs *fs, inode *start, const char *path, size_t path_len,
+                   uint64_t removals, inode *result, int err,
+                   inode *miss_dir) {
+  uint32_t hash = hash_key(start, path, path_len);
+  dcache_entry *entry = &dcache[hash & (DCACHE_SIZE - 1)];
+
+  // Path buffers are kept per slot and only ever grow
+  if (entry->path_capacity < path_len + 1) {
+    char *buffer = realloc(entry->path, path_len + 1);
+    if (buffer == NULL) {
+      return;
+    }
+    entry->path = buffer;
+    entry->path_capacity = path_len + 1;
+  }
+
+  memcpy(entry->path, path, path_len);
+  entry->path[path_len] = '\0';
+  entry->path_len = path_len;
+  entry->hash = hash;
+  entry->fs_id = fs->id;
+  entry->start = start;
+  entry->removals = removals;
+  entry->err = err;
+  entry->result = result;
+  entry->miss_dir = miss_dir;
+  entry->miss_generation =
+      miss_dir != NULL ? __atomic_load_n(&miss_dir->generation, __ATOMIC_ACQUIRE)
+                       : 0;
+}
+
+void dcache_clear(void) {
+  for (size_t i = 0; i < DCACHE_SIZE; i++) {
+    free(dcache[i].path);
+  }
+  memset(dcache, 0, sizeof(dcache));
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "fs.h"
+
+#define DCACHE_SIZE 4096 // Number of cached paths, must be a power of two
+
+// Cached result of resolve_path for a path relative to a starting directory.
+// Positive entries stay valid until any entry is removed from any directory,
+// negative ones also die when the directory the lookup failed in changes.
+// Each thread has its own cache, shared by every instance it works on.
+typedef struct dcache_entry {
+  uint64_t fs_id; // Instance the lookup ran in, see _fs.id
+  inode *start;
+  char *path;
+  size_t path_len;
+  size_t path_capacity;
+  uint32_t hash;
+  uint64_t removals;        // fs.removals when the lookup started
+  int err;                  // 0, ENOENT or ENOTDIR
+  inode *result;            // What resolve_path left in *result
+  inode *miss_dir;          // Directory the lookup failed in, for ENOENT
+  uint32_t miss_generation; // miss_dir->generation at fill time
+} dcache_entry;
+
+const dcache_entry *dcache_lookup(_fs *fs, inode *start, const char *path,
+                                  size_t path_len);
+bool dcache_valid(_fs *fs, const dcache_entry *entry);
+// removals is fs->removals from before the lookup started
+void dcache_insert(_fs *fs, inode *start, const char *path, size_t path_len,
+                   uint64_t removals, inode *result, int err,
+                   inode *miss_dir);
+void dcache_clear(void);
@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "file.h"
+#include "stats.h"
+
+#define DEDUP_SHARDS 64 // Separately locked parts of the store, a power of two
+#define DEDUP_MIN_SLOTS 64
+
+// Open addressing with linear probing. Slots hold the extents themselves,
+// their hash says where they belong: the low bits pick the shard, the rest
+// the slot.
+typedef struct dedup_shard {
+  pthread_mutex_t lock;
+  extent **slots;
+  size_t capacity; // A power of two, or 0
+  size_t count;
+} dedup_shard;
+
+bool dedup_enabled = false;
+
+static dedup_shard shards[DEDUP_SHARDS];
+
+void dedup_enable(void) {
+  for (size_t i = 0; i < DEDUP_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+  dedup_enabled = true;
+}
+
+static uint64_t rotate(uint64_t x, int bits) {
+  return x << bits | x >> (64 - bits);
+}
+
+// Multiply and shift over 8 byte words. Four lanes work on interleaved
+// words, so their multiplies overlap instead of each waiting on the last,
+// which is what hashing a block costs.
+uint32_t dedup_hash(const char *bytes, size_t len) {
+  const uint64_t prime = 0x9e3779b97f4a7c15u;
+  uint64_t lanes[4] = {len, prime, prime << 1, prime << 2};
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    for (int lane = 0; lane < 4; lane++) {
+      uint64_t word = 0;
+      memcpy(&word, bytes + i + lane * 8, sizeof(word));
+      lanes[lane] = (lanes[lane] ^ word) * prime;
+      lanes[lane] ^= lanes[lane] >> 29;
+    }
+  }
+
+  uint64_t hash = lanes[0] ^ rotate(lanes[1], 16) ^ rotate(lanes[2], 32) ^
+                  rotate(lanes[3], 48);
+  for (; i < len; i++) {
+    hash = (hash ^ (uint8_t)bytes[i]) * 0xff51afd7ed558ccdu;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53u;
+  hash ^= hash >> 33;
+
+  uint32_t folded = (uint32_t)(hash ^ (hash >> 32));
+  return folded != 0 ? folded : 1;
+}
+
+static dedup_shard *shard_of(uint32_t hash) {
+  return &shards[hash & (DEDUP_SHARDS - 1)];
+}
+
+static size_t home_of(uint32_t hash, size_t capacity) {
+  return (hash / DEDUP_SHARDS) & (capacity - 1);
+}
+
+static void place(extent **slots, size_t capacity, extent *e) {
+  size_t i = home_of(e->hash, capacity);
+  while (slots[i] != NULL) {
+    i = (i + 1) & (capacity - 1);
+  }
+  slots[i] = e;
+}
+
+// Keep the table at most three quarters full
+static int reserve_slot(dedup_shard *s) {
+  if ((s->count + 1) * 4 <= s->capacity * 3) {
+    return 0;
+  }
+
+  size_t capacity = s->capacity == 0 ? DEDUP_MIN_SLOTS : s->capacity * 2;
+  extent **slots = calloc(capacity, sizeof(extent *));
+  if (slots == NULL) {
+    return ENOMEM;
+  }
+  for (size_t i = 0; i < s->capacity; i++) {
+    if (s->slots[i] != NULL) {
+      place(slots, capacity, s->slots[i]);
+    }
+  }
+  free(s->slots);
+  s->slots = slots;
+  s->capacity = capacity;
+  return 0;
+}
+
+// Take a reference unless the last one is already gone, put_extent is then
+// waiting for the lock to take the extent out
+static bool try_get(extent *e) {
+  uint32_t refs = __atomic_load_n(&e->refs, __ATOMIC_RELAXED);
+  while (refs != 0) {
+    if (__atomic_compare_exchange_n(&e->refs, &refs, refs + 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+extent *dedup_block(const char *bytes, size_t len) {
+  uint32_t hash = dedup_hash(bytes, len);
+  dedup_shard *s = shard_of(hash);
+  pthread_mutex_lock(&s->lock);
+
+  for (size_t i = s->capacity == 0 ? 0 : home_of(hash, s->capacity);
+       s->capacity > 0 && s->slots[i] != NULL;
+       i = (i + 1) & (s->capacity - 1)) {
+    extent *e = s->slots[i];
+    if (e->hash == hash && e->len == len &&
+        memcmp(e->bytes, bytes, len) == 0 && try_get(e)) {
+      pthread_mutex_unlock(&s->lock);
+      stat_add(STAT_DEDUP_HITS, 1);
+      return e;
+    }
+  }
+
+  extent *e = reserve_slot(s) == 0 ? new_extent(len) : NULL;
+  if (e != NULL) {
+    memcpy(e->bytes, bytes, len);
+    e->len = (uint32_t)len;
+    e->hash = hash;
+    place(s->slots, s->capacity, e);
+    s->count++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return e;
+}
+
+void dedup_forget(extent *e) {
+  dedup_shard *s = shard_of(e->hash);
+  pthread_mutex_lock(&s->lock);
+  size_t mask = s->capacity - 1;
+  size_t hole = home_of(e->hash, s->capacity);
+  while (s->slots[hole] != e) {
+    hole = (hole + 1) & mask;
+  }
+
+  // Move later extents of the run back into the hole, unless that would put
+  // one before its home, where lookups would no longer find it
+  for (size_t i = (hole + 1) & mask; s->slots[i] != NULL;
+       i = (i + 1) & mask) {
+    size_t home = home_of(s->slots[i]->hash, s->capacity);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      s->slots[hole] = s->slots[i];
+      hole = i;
+    }
+  }
+  s->slots[hole] = NULL;
+  s->count--;
+  pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file.h"
+
+#define DEDUP_BLOCK_SIZE 4096 // Whole-file writes are split at these
+
+// Content-addressed store of file blocks: identical blocks written to any
+// number of files are kept once, as one extent whose reference count is the
+// number of tables holding it.
+//
+// Off unless dedup_enable was called. The store only indexes the extents,
+// it does not own them: put_extent takes an extent out with its last
+// reference. Stored extents are full, so appends never write into them, and
+// positional writes copy them like any shared extent.
+
+extern bool dedup_enabled;
+
+void dedup_enable(void);
+
+// Never 0, which marks extents the store does not hold
+uint32_t dedup_hash(const char *bytes, size_t len);
+
+// An extent holding exactly these bytes, with a reference for the caller,
+// NULL if a new one could not be allocated
+extent *dedup_block(const char *bytes, size_t len);
+
+// Called by put_extent once the last reference to a stored extent is gone
+void dedup_forget(extent *e);
@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dir.h"
+#include "epoch.h"
+#include "fs.h"
+#include "stats.h"
+#include "util.h"
+
+#define DIR_MIN_CAPACITY 4
+#define DIR_MIN_INDEX 8
+
+// FNV-1a, good enough for short file names
+static uint32_t hash_name(const char *name) {
+  uint32_t hash = 2166136261u;
+  while (*name != '\0') {
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static dir_slot make_slot(uint32_t hash, uint32_t position) {
+  return (dir_slot)hash << 32 | position;
+}
+
+static uint32_t slot_hash(dir_slot slot) { return (uint32_t)(slot >> 32); }
+
+static uint32_t slot_position(dir_slot slot) { return (uint32_t)slot; }
+
+directory *dir_table(const inode *dir) {
+  return __atomic_load_n(&dir->data, __ATOMIC_ACQUIRE);
+}
+
+size_t dir_used(const directory *d) {
+  if (d == NULL) {
+    return 0;
+  }
+  return __atomic_load_n(&d->count, __ATOMIC_ACQUIRE);
+}
+
+inode *dir_item(const DIR_ENTRY *entry) {
+  return __atomic_load_n(&entry->item, __ATOMIC_ACQUIRE);
+}
+
+bool dir_sorted(const inode *dir) {
+  const directory *d = dir_table(dir);
+  return d == NULL || __atomic_load_n(&d->sorted, __ATOMIC_ACQUIRE);
+}
+
+size_t dir_count(const inode *dir) {
+  const directory *d = dir->data;
+  return d == NULL ? 0 : d->live;
+}
+
+// Find the entry holding a name, without writing anything
+static const DIR_ENTRY *find_entry(const directory *d, const char *name) {
+  if (d == NULL) {
+    return NULL;
+  }
+
+  uint32_t hash = hash_name(name);
+  size_t i = hash & d->index_mask;
+  for (;;) {
+    dir_slot slot = __atomic_load_n(&d->index[i], __ATOMIC_ACQUIRE);
+    uint32_t position = slot_position(slot);
+    if (position == 0) {
+      return NULL;
+    }
+    if (position != DIR_TOMBSTONE && slot_hash(slot) == hash &&
+        strcmp(d->entries[position - 1].name, name) == 0) {
+      return &d->entries[position - 1];
+    }
+    i = (i + 1) & d->index_mask;
+  }
+}
+
+// Find the slot holding a name, or the empty slot where it would go. Only
+// writers use it, nobody else changes the index meanwhile.
+static size_t find_slot(const directory *d, const char *name, uint32_t hash) {
+  size_t i = hash & d->index_mask;
+  while (slot_position(d->index[i]) != 0) {
+    uint32_t position = slot_position(d->index[i]);
+    if (position != DIR_TOMBSTONE && slot_hash(d->index[i]) == hash &&
+        strcmp(d->entries[position - 1].name, name) == 0) {
+      return i;
+    }
+    i = (i + 1) & d->index_mask;
+  }
+  return i;
+}
+
+// Allocate an empty table with room for capacity entries. The index is at
+// least twice that, it never gets more than half full before the table does.
+static directory *alloc_table(size_t capacity) {
+  size_t index_size = DIR_MIN_INDEX;
+  while (index_size < capacity * 2) {
+    index_size *= 2;
+  }
+
+  directory *d = calloc(1, sizeof(directory) + capacity * sizeof(DIR_ENTRY) +
+                               index_size * sizeof(dir_slot));
+  if (d == NULL) {
+    return NULL;
+  }
+  d->capacity = capacity;
+  d->index_mask = index_size - 1;
+  d->index = (dir_slot *)(d->entries + capacity);
+  d->sorted = true;
+  return d;
+}
+
+// Append an entry and point a slot at it. Readers see neither before the
+// slot and count are stored.
+static void append_entry(directory *d, const char *name, inode *target,
+                         uint32_t hash) {
+  DIR_ENTRY *entry = &d->entries[d->count];
+  strcpy(entry->name, name);
+  __atomic_store_n(&entry->item, target, __ATOMIC_RELAXED);
+
+  // Appending in order keeps the directory sorted, anything else is sorted
+  // lazily when listed
+  if (d->count > 2 && strcmp(d->entries[d->count - 1].name, name) > 0) {
+    __atomic_store_n(&d->sorted, false, __ATOMIC_RELEASE);
+  }
+
+  size_t i = hash & d->index_mask;
+  while (slot_position(d->index[i]) != 0) {
+    i = (i + 1) & d->index_mask;
+  }
+  __atomic_store_n(&d->index[i], make_slot(hash, (uint32_t)d->count + 1),
+                   __ATOMIC_RELEASE);
+  d->live++;
+  __atomic_store_n(&d->count, d->count + 1, __ATOMIC_RELEASE);
+}
+
+// Copy the entries still there into a new table with room for capacity,
+// sorting them on the way if asked
+static directory *rebuild(const directory *old, size_t capacity, bool sort) {
+  stat_add(STAT_DIR_REBUILDS, 1);
+  directory *d = alloc_table(capacity);
+  if (d == NULL || old == NULL) {
+    return d;
+  }
+
+  size_t count = 0;
+  for (size_t i = 0; i < old->count; i++) {
+    if (old->entries[i].item != NULL) {
+      d->entries[count++] = old->entries[i];
+    }
+  }
+  if (sort && count > 2) {
+    stat_add(STAT_DIR_SORTS, 1);
+    qsort(d->entries + 2, count - 2, sizeof(DIR_ENTRY), compare_entries);
+  }
+  d->sorted = sort || old->sorted;
+
+  // Nobody sees the table yet, the index can be filled in directly
+  for (size_t pos = 0; pos < count; pos++) {
+    uint32_t hash = hash_name(d->entries[pos].name);
+    size_t i = hash & d->index_mask;
+    while (d->index[i] != 0) {
+      i = (i + 1) & d->index_mask;
+    }
+    d->index[i] = make_slot(hash, (uint32_t)pos + 1);
+  }
+  d->count = count;
+  d->live = count;
+  return d;
+}
+
+// Make d the table of dir, readers still on the old one keep it until they
+// leave their section
+static void publish(inode *dir, directory *d) {
+  directory *old = dir->data;
+  __atomic_store_n(&dir->data, (void *)d, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&dir->generation, 1, __ATOMIC_RELEASE);
+  if (old != NULL) {
+    dir_retire(old);
+  }
+}
+
+int dir_lookup(const inode *dir, const char *name) {
+  const directory *d = dir_table(dir);
+  const DIR_ENTRY *entry = find_entry(d, name);
+  if (entry == NULL || dir_item(entry) == NULL) {
+    return -1;
+  }
+  return (int)(entry - d->entries);
+}
+
+inode *dir_find(const inode *dir, const char *name) {
+  const DIR_ENTRY *entry = find_entry(dir_table(dir), name);
+  return entry == NULL ? NULL : dir_item(entry);
+}
+
+int dir_insert(inode *dir, const char *name, inode *target) {
+  if (strlen(name) >= sizeof(((DIR_ENTRY *)NULL)->name)) {
+    return ENAMETOOLONG;
+  }
+
+  directory *d = dir->data;
+  uint32_t hash = hash_name(name);
+  if (d != NULL && slot_position(d->index[find_slot(d, name, hash)]) != 0) {
+    return EEXIST;
+  }
+
+  // Grow geometrically from what is left, removed entries are dropped on the
+  // way
+  if (d == NULL || d->count == d->capacity) {
+    size_t capacity = d == NULL ? 0 : d->live * 2;
+    if (capacity < DIR_MIN_CAPACITY) {
+      capacity = DIR_MIN_CAPACITY;
+    }
+    directory *grown = rebuild(d, capacity, false);
+    if (grown == NULL) {
+      return ENOMEM;
+    }
+    publish(dir, grown);
+    d = grown;
+  }
+
+  append_entry(d, name, target, hash);
+  __atomic_add_fetch(&dir->generation, 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+int dir_remove(inode *dir, const char *name) {
+  directory *d = dir->data;
+  if (d == NULL) {
+    return ENOENT;
+  }
+
+  size_t slot = find_slot(d, name, hash_name(name));
+  uint32_t position = slot_position(d->index[slot]);
+  if (position == 0) {
+    return ENOENT;
+  }
+
+  // Entries never move within a table, a reader that already found this one
+  // sees it gone once it loads the item
+  __atomic_store_n(&d->entries[position - 1].item, NULL, __ATOMIC_RELEASE);
+  __atomic_store_n(&d->index[slot], make_slot(0, DIR_TOMBSTONE),
+                   __ATOMIC_RELEASE);
+  d->live--;
+  __atomic_add_fetch(&dir->generation, 1, __ATOMIC_RELEASE);
+
+  // Compact once removed entries make up most of the table. Failing to is
+  // harmless, the next append that finds it full tries again.
+  if (d->count > DIR_MIN_CAPACITY && d->live * 4 < d->count) {
+    size_t capacity = d->live * 2;
+    if (capacity < DIR_MIN_CAPACITY) {
+      capacity = DIR_MIN_CAPACITY;
+    }
+    directory *compact = rebuild(d, capacity, false);
+    if (compact != NULL) {
+      publish(dir, compact);
+    }
+  }
+
+  return 0;
+}
+
+void dir_sort(inode *dir) {
+  directory *d = dir->data;
+  if (d == NULL || d->sorted) {
+    return;
+  }
+
+  // On failure the table just stays unsorted
+  directory *sorted = rebuild(d, d->capacity, true);
+  if (sorted != NULL) {
+    publish(dir, sorted);
+  }
+}
+
+directory *dir_detach(inode *dir) {
+  directory *d = dir->data;
+  if (d == NULL || d->live <= 2) {
+    return NULL;
+  }
+
+  directory *empty = alloc_table(DIR_MIN_CAPACITY);
+  if (empty == NULL) {
+    exit(ENOMEM);
+  }
+  for (size_t i = 0; i < 2; i++) {
+    append_entry(empty, d->entries[i].name, d->entries[i].item,
+                 hash_name(d->entries[i].name));
+  }
+
+  // publish would retire it, the caller still needs it
+  __atomic_store_n(&dir->data, (void *)empty, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&dir->generation, 1, __ATOMIC_RELEASE);
+  return d;
+}
+
+void dir_retire(directory *d) { epoch_retire(free, d); }
+
+void dir_free(inode *dir) {
+  free(dir->data);
+  dir->data = NULL;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "fs.h"
+
+// Slot of the open addressing index: the name's hash in the high half, the
+// entry position + 1 in the low half, so a zeroed slot is empty. A removed
+// entry leaves DIR_TOMBSTONE behind for probes to go on past.
+typedef uint64_t dir_slot;
+
+#define DIR_TOMBSTONE UINT32_MAX
+
+// Directory contents, stored in inode->data for S_IFDIR inodes. The table
+// holds capacity entries followed by the index, in one allocation. entries
+// is dense and always starts with "." and "..", the index maps names to
+// positions in entries.
+//
+// Lookups and listings take no lock, they run inside an epoch section (see
+// epoch.h) on whatever table they found in inode->data. Writers hold the
+// directory's lock for writing and only change a published table in ways
+// readers can race with: an entry is appended past count before count
+// moves, a removed one gets its item cleared and its slot turned into a
+// tombstone. Growing, dropping removed entries and sorting build a new
+// table, publish it and retire the old one.
+typedef struct directory {
+  size_t count; // Entries appended so far, removed ones included
+  size_t live;  // Entries not removed
+  size_t capacity;
+  size_t index_mask; // Index size - 1, index size is a power of two
+  dir_slot *index;
+  bool sorted; // Names after "." and ".." are in order, removed ones too
+  DIR_ENTRY entries[];
+} directory;
+
+// Readers take the table once and walk entries up to dir_used, skipping
+// entries whose dir_item is NULL
+directory *dir_table(const inode *dir);
+size_t dir_used(const directory *d);
+inode *dir_item(const DIR_ENTRY *entry);
+bool dir_sorted(const inode *dir);
+size_t dir_count(const inode *dir); // Entries not removed
+
+// Position of name in the current table, -1 if missing
+int dir_lookup(const inode *dir, const char *name);
+inode *dir_find(const inode *dir, const char *name);
+int dir_insert(inode *dir, const char *name, inode *target);
+int dir_remove(inode *dir, const char *name);
+
+// Replace the table with one holding only "." and "..", returning the old one
+// for the caller to walk and then hand to dir_retire. NULL if there was
+// nothing else in it.
+directory *dir_detach(inode *dir);
+void dir_retire(directory *d);
+
+void dir_sort(inode *dir);
+// Free the table right away, once no reader can reach the directory
+void dir_free(inode *dir);
@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+#define EPOCH_BATCH 64 // Retired pointers collected before they are queued
+
+typedef struct retired {
+  retire_fn fn;
+  void *ptr;
+} retired;
+
+// Pointers retired by one thread, freed together once the global epoch is
+// two past the one the batch was queued in
+typedef struct batch {
+  struct batch *next;
+  uint64_t epoch;
+  size_t count;
+  retired items[EPOCH_BATCH];
+} batch;
+
+// One per thread, on its own cache line so entering and leaving sections
+// never writes anything another thread reads often. Records outlive their
+// threads and are handed to new ones.
+typedef struct epoch_record {
+  _Alignas(64) uint64_t epoch; // Global epoch when the section started, or 0
+  unsigned depth;
+  bool owned;
+  batch *current; // Being filled, only touched by the owner
+  struct epoch_record *next;
+} epoch_record;
+
+static uint64_t global_epoch = 1;
+static epoch_record *records = NULL;
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Queued batches, oldest first
+static batch *limbo_head = NULL;
+static batch *limbo_tail = NULL;
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static _Thread_local epoch_record *self = NULL;
+
+// Queue the batch being filled, stamped with the epoch it is queued in. Every
+// pointer in it was retired in that epoch or before.
+static void queue_batch(epoch_record *r) {
+  batch *b = r->current;
+  if (b == NULL || b->count == 0) {
+    return;
+  }
+  r->current = NULL;
+
+  b->next = NULL;
+  b->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&limbo_lock);
+  if (limbo_tail == NULL) {
+    limbo_head = b;
+  } else {
+    limbo_tail->next = b;
+  }
+  limbo_tail = b;
+  pthread_mutex_unlock(&limbo_lock);
+}
+
+// A finished thread keeps nothing to itself, its record goes back to the pool
+static void release_record(void *arg) {
+  epoch_record *r = arg;
+  queue_batch(r);
+  r->depth = 0;
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&r->owned, false, __ATOMIC_RELEASE);
+}
+
+static void create_key(void) {
+  if (pthread_key_create(&record_key, release_record) != 0) {
+    exit(ENOMEM);
+  }
+}
+
+static epoch_record *get_record(void) {
+  if (self != NULL) {
+    return self;
+  }
+  pthread_once(&record_once, create_key);
+
+  pthread_mutex_lock(&records_lock);
+  epoch_record *r = records;
+  while (r != NULL && __atomic_load_n(&r->owned, __ATOMIC_ACQUIRE)) {
+    r = r->next;
+  }
+  if (r == NULL) {
+    r = aligned_alloc(64, sizeof(epoch_record));
+    if (r == NULL) {
+      exit(ENOMEM);
+    }
+    *r = (epoch_record){.next = records};
+    // Published last, advance walks the list without the lock
+    __atomic_store_n(&records, r, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&r->owned, true, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&records_lock);
+
+  pthread_setspecific(record_key, r);
+  self = r;
+  return r;
+}
+
+// Move the global epoch on if every thread inside a section has seen it
+static void try_advance(void) {
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  for (epoch_record *r = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+       r != NULL; r = r->next) {
+    uint64_t seen = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+    if (seen != 0 && seen != epoch) {
+      return;
+    }
+  }
+  __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// The callbacks may retire more, so no lock is held while they run
+static void free_batches(batch *done) {
+  while (done != NULL) {
+    batch *next = done->next;
+    for (size_t i = 0; i < done->count; i++) {
+      done->items[i].fn(done->items[i].ptr);
+    }
+    free(done);
+    done = next;
+  }
+}
+
+// Free the batches nobody can see any more
+static void reclaim(void) {
+  try_advance();
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&limbo_lock);
+  batch *done = limbo_head;
+  batch *last = NULL;
+  for (batch *b = limbo_head; b != NULL && b->epoch + 2 <= epoch;
+       b = b->next) {
+    last = b;
+  }
+  if (last == NULL) {
+    pthread_mutex_unlock(&limbo_lock);
+    return;
+  }
+  limbo_head = last->next;
+  if (last->next == NULL) {
+    limbo_tail = NULL;
+  }
+  last->next = NULL;
+  pthread_mutex_unlock(&limbo_lock);
+
+  free_batches(done);
+}
+
+void epoch_enter(void) {
+  epoch_record *r = get_record();
+  if (r->depth++ > 0) {
+    return;
+  }
+  // Announced before anything shared is read
+  __atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+                   __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+  epoch_record *r = self;
+  if (--r->depth > 0) {
+    return;
+  }
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_SEQ_CST);
+
+  // Threads that retired something are the ones that clean up, pure readers
+  // leave without touching anything shared
+  if (r->current != NULL && r->current->count > 0) {
+    queue_batch(r);
+    reclaim();
+  }
+}
+
+void epoch_retire(retire_fn fn, void *ptr) {
+  epoch_record *r = get_record();
+  if (r->current == NULL) {
+    r->current = malloc(sizeof(batch));
+    if (r->current == NULL) {
+      exit(ENOMEM);
+    }
+    r->current->count = 0;
+  }
+
+  batch *b = r->current;
+  b->items[b->count++] = (retired){fn, ptr};
+  if (b->count == EPOCH_BATCH) {
+    queue_batch(r);
+    reclaim();
+  }
+}
+
+void epoch_synchronize(void) {
+  epoch_record *r = get_record();
+
+  // Our own section would hold the epoch back, it does not count here
+  uint64_t seen = __atomic_load_n(&r->epoch, __ATOMIC_RELAXED);
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_SEQ_CST);
+
+  // Two steps past now, every batch queued so far is old enough
+  queue_batch(r);
+  uint64_t target = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) + 2;
+  while (__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) < target) {
+    try_advance();
+    if (__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) < target) {
+      sched_yield();
+    }
+  }
+  reclaim();
+
+  if (seen != 0) {
+    __atomic_store_n(&r->epoch,
+                     __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// Epoch based reclamation, so lookups can walk the tree without taking locks.
+//
+// Readers wrap their accesses in epoch_enter and epoch_exit, which only
+// touch a record private to their thread. Writers unlink what they replace
+// and hand it to epoch_retire instead of freeing it: it is freed once every
+// thread that was inside a section at the time has left it. Sections nest,
+// and pointers picked up inside one stay valid until the outermost ends.
+
+typedef void (*retire_fn)(void *ptr);
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(retire_fn fn, void *ptr);
+
+// Wait until nothing retired so far can still be seen by another thread, and
+// free what no other thread got to first. Callbacks may retire more, which
+// waits for the next round. The caller may be inside a section, but must not
+// keep using anything that was retired, and no thread may be waiting inside a
+// section for a lock the caller holds.
+void epoch_synchronize(void);
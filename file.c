@@ -0,0 +1,484 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dedup.h"
+#include "epoch.h"
+#include "file.h"
+#include "fs.h"
+#include "pack.h"
+#include "spill.h"
+#include "stats.h"
+
+extent *new_extent(size_t capacity) {
+  extent *e = malloc(sizeof(extent) + capacity);
+  if (e == NULL) {
+    return NULL;
+  }
+  e->len = 0;
+  e->capacity = (uint32_t)capacity;
+  e->refs = 1;
+  e->hash = 0;
+  e->packed = 0;
+  e->spilled = 0;
+  stat_add(STAT_EXTENT_BYTES, capacity);
+  stat_add(STAT_PHYSICAL_BYTES, capacity);
+  spill_account(capacity);
+  return e;
+}
+
+// What the bytes of e take in memory
+static size_t extent_memory(const extent *e) {
+  if (e->spilled != 0) {
+    return 0;
+  }
+  return e->packed != 0 ? e->packed : e->capacity;
+}
+
+void put_extent(extent *e) {
+  if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (e->hash != 0) {
+      dedup_forget(e);
+    }
+    if (!extent_plain(e)) {
+      pack_forget(e);
+    }
+    if (e->spilled != 0) {
+      spill_forget(e);
+    }
+    stat_add(STAT_PHYSICAL_BYTES, -(uint64_t)extent_memory(e));
+    spill_account(-(uint64_t)extent_memory(e));
+    free(e);
+  }
+}
+
+static void put_retired_extent(void *arg) { put_extent(arg); }
+
+// The first len bytes of e as they read, into dest. A packed or spilled
+// extent is unpacked whole, dest must have room for all of it.
+static void copy_bytes(char *dest, const extent *e, size_t len) {
+  if (!extent_plain(e)) {
+    unpack_bytes(e, dest);
+  } else {
+    memcpy(dest, e->bytes, len);
+  }
+}
+
+// Runs once no reader can still be looking at f
+static void free_data(void *arg) {
+  file_data *f = arg;
+  for (size_t i = 0; i < f->count; i++) {
+    put_extent(f->extents[i]);
+  }
+  free(f->extents);
+  if (f->image != NULL) {
+    mapping_put(f->image);
+  }
+  free(f);
+}
+
+// Make sure the extent table has room for one more extent. A reader may be
+// walking the current one, so it is replaced rather than reallocated.
+static int reserve_extent(file_data *f) {
+  if (f->count < f->capacity) {
+    return 0;
+  }
+
+  size_t capacity = f->capacity == 0 ? 1 : f->capacity * 2;
+  extent **extents = malloc(capacity * sizeof(extent *));
+  if (extents == NULL) {
+    return ENOMEM;
+  }
+  stat_add(STAT_EXTENT_TABLE_BYTES, capacity * sizeof(extent *));
+  if (f->count > 0) {
+    memcpy(extents, f->extents, f->count * sizeof(extent *));
+  }
+
+  extent **old = f->extents;
+  __atomic_store_n(&f->extents, extents, __ATOMIC_RELEASE);
+  f->capacity = capacity;
+  if (old != NULL) {
+    epoch_retire(free, old);
+  }
+  return 0;
+}
+
+// Add an extent after the last one, visible to readers once count moves
+static int push_extent(file_data *f, extent *e) {
+  if (reserve_extent(f) != 0) {
+    return ENOMEM;
+  }
+  f->extents[f->count] = e;
+  __atomic_store_n(&f->count, f->count + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Append to contents only this file uses, *size is the file size so far
+static int append_data(file_data *f, size_t *size, const char *data,
+                       size_t len) {
+  while (len > 0) {
+    // Fill whatever room is left in the last extent first, unless a copy
+    // still shares it or it is packed or spilled. Readers stop at len, so
+    // the bytes go in first.
+    if (f->count > 0 && extent_plain(f->extents[f->count - 1]) &&
+        __atomic_load_n(&f->extents[f->count - 1]->refs, __ATOMIC_ACQUIRE) ==
+            1) {
+      extent *last = f->extents[f->count - 1];
+      size_t room = last->capacity - last->len;
+      size_t chunk = len < room ? len : room;
+      memcpy(last->bytes + last->len, data, chunk);
+      __atomic_store_n(&last->len, last->len + (uint32_t)chunk,
+                       __ATOMIC_RELEASE);
+      *size += chunk;
+      data += chunk;
+      len -= chunk;
+      if (len == 0) {
+        break;
+      }
+    }
+
+    // New extents grow with the file, which keeps appends amortized O(len)
+    size_t capacity = *size;
+    if (capacity < EXTENT_MIN_SIZE) {
+      capacity = EXTENT_MIN_SIZE;
+    }
+    if (capacity > EXTENT_MAX_SIZE) {
+      capacity = EXTENT_MAX_SIZE;
+    }
+    extent *e = new_extent(capacity);
+    if (e == NULL) {
+      return ENOMEM;
+    }
+    if (push_extent(f, e) != 0) {
+      free(e);
+      return ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+// Every change to the contents ends here, which makes it the place to note
+// they were used. Symlinks keep their target's length in data_size, which is
+// not counted.
+static void set_size(inode *file, size_t size) {
+  if (file->filetype == S_IFREG) {
+    stat_add(STAT_LOGICAL_BYTES, size - file->data_size);
+  }
+  file->data_size = size;
+  pack_touch(file);
+}
+
+// Point the file at other contents, readers of the old ones keep them until
+// they leave their section
+static void replace_data(inode *file, file_data *f, size_t size) {
+  file_data *old = file->data;
+  __atomic_store_n(&file->data, (void *)f, __ATOMIC_RELEASE);
+  set_size(file, size);
+  file_drop(old);
+}
+
+// Split into blocks, each shared with every file that has the same bytes.
+// f is new and has room for all of them.
+static int dedup_data(file_data *f, size_t *size, const char *data,
+                      size_t len) {
+  for (size_t at = 0; at < len; at += DEDUP_BLOCK_SIZE) {
+    size_t chunk = len - at < DEDUP_BLOCK_SIZE ? len - at : DEDUP_BLOCK_SIZE;
+    extent *e = dedup_block(data + at, chunk);
+    if (e == NULL) {
+      return ENOMEM;
+    }
+    f->extents[f->count++] = e;
+    *size += chunk;
+  }
+  return 0;
+}
+
+// Return file_data that only this inode uses, breaking sharing with copies
+static file_data *own_data(inode *file) {
+  file_data *shared = file->data;
+  if (shared != NULL &&
+      __atomic_load_n(&shared->refs, __ATOMIC_ACQUIRE) == 1) {
+    return shared;
+  }
+
+  file_data *f = calloc(1, sizeof(file_data));
+  if (f == NULL) {
+    return NULL;
+  }
+  f->refs = 1;
+  if (shared == NULL) {
+    replace_data(file, f, 0);
+    return f;
+  }
+
+  // Only the extent table is copied, the extents themselves stay shared
+  f->extents = malloc(shared->count * sizeof(extent *));
+  if (f->extents == NULL && shared->count > 0) {
+    free(f);
+    return NULL;
+  }
+  for (size_t i = 0; i < shared->count; i++) {
+    f->extents[i] = shared->extents[i];
+    __atomic_add_fetch(&f->extents[i]->refs, 1, __ATOMIC_RELAXED);
+  }
+  f->count = shared->count;
+  f->capacity = shared->count;
+  f->image = shared->image;
+  if (f->image != NULL) {
+    __atomic_add_fetch(&f->image->refs, 1, __ATOMIC_RELAXED);
+  }
+
+  replace_data(file, f, file->data_size);
+  return f;
+}
+
+int file_write(inode *file, const char *data, size_t len) {
+  // Nothing of the old contents survives, so the new ones are built on the
+  // side and swapped in whole
+  file_data *f = calloc(1, sizeof(file_data));
+  if (f == NULL) {
+    return ENOMEM;
+  }
+  f->refs = 1;
+
+  // Overwrites tend to be final, so the first extent is sized exactly
+  size_t size = 0;
+  int err = 0;
+  if (dedup_enabled && len > 0) {
+    size_t blocks = (len + DEDUP_BLOCK_SIZE - 1) / DEDUP_BLOCK_SIZE;
+    f->extents = malloc(blocks * sizeof(extent *));
+    f->capacity = blocks;
+    err = f->extents != NULL ? dedup_data(f, &size, data, len) : ENOMEM;
+  } else if (len > 0) {
+    size_t first = len < EXTENT_MAX_SIZE ? len : EXTENT_MAX_SIZE;
+    extent *e = new_extent(first);
+    if (e == NULL || push_extent(f, e) != 0) {
+      free(e);
+      err = ENOMEM;
+    } else {
+      memcpy(e->bytes, data, first);
+      e->len = (uint32_t)first;
+      size = first;
+      err = append_data(f, &size, data + first, len - first);
+    }
+  }
+  if (err != 0) {
+    free_data(f);
+    return err;
+  }
+
+  replace_data(file, f, size);
+  return 0;
+}
+
+int file_append(inode *file, const char *data, size_t len) {
+  file_data *f = own_data(file);
+  if (f == NULL) {
+    return ENOMEM;
+  }
+  stat_add(STAT_APPEND_BYTES, len);
+  size_t size = file->data_size;
+  int err = append_data(f, &size, data, len);
+  set_size(file, size);
+  return err;
+}
+
+// Grow the file with zeros up to size
+static int append_zeros(file_data *f, size_t *size, size_t target) {
+  static const char zeros[4096];
+  while (*size < target) {
+    size_t chunk = target - *size;
+    if (chunk > sizeof(zeros)) {
+      chunk = sizeof(zeros);
+    }
+    int err = append_data(f, size, zeros, chunk);
+    if (err != 0) {
+      return err;
+    }
+  }
+  return 0;
+}
+
+size_t file_extent_at(extent **extents, size_t count, size_t offset,
+                      size_t *start) {
+  size_t at = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t len = __atomic_load_n(
+        &__atomic_load_n(&extents[i], __ATOMIC_ACQUIRE)->len, __ATOMIC_ACQUIRE);
+    if (offset < at + len) {
+      *start = at;
+      return i;
+    }
+    at += len;
+  }
+  *start = at;
+  return count;
+}
+
+// Only the extents the bytes land in are copied, each is swapped for its
+// copy in the table, where readers pick up either one whole
+int file_pwrite(inode *file, const char *data, size_t len, size_t offset) {
+  file_data *f = own_data(file);
+  if (f == NULL) {
+    return ENOMEM;
+  }
+  size_t size = file->data_size;
+  int err = append_zeros(f, &size, offset);
+  set_size(file, size);
+  if (err != 0) {
+    return err;
+  }
+
+  size_t start = 0;
+  size_t i = file_extent_at(f->extents, f->count, offset, &start);
+  for (; len > 0 && i < f->count; i++) {
+    extent *old = f->extents[i];
+    if (offset >= start + old->len) {
+      start += old->len;
+      continue;
+    }
+    size_t at = offset - start;
+    size_t chunk = old->len - at < len ? old->len - at : len;
+
+    // Same capacity, so appends to the last extent carry on filling it
+    extent *copy = new_extent(old->capacity);
+    if (copy == NULL) {
+      return ENOMEM;
+    }
+    copy_bytes(copy->bytes, old, old->len);
+    memcpy(copy->bytes + at, data, chunk);
+    copy->len = old->len;
+    __atomic_store_n(&f->extents[i], copy, __ATOMIC_RELEASE);
+    epoch_retire(put_retired_extent, old);
+
+    start += old->len;
+    offset += chunk;
+    data += chunk;
+    len -= chunk;
+  }
+
+  // Whatever is left goes past the end
+  err = append_data(f, &size, data, len);
+  set_size(file, size);
+  return err;
+}
+
+// Cutting builds a new table on the side like an overwrite, sharing every
+// extent that is kept whole. Growing appends zeros.
+int file_truncate(inode *file, size_t size) {
+  if (size == file->data_size) {
+    return 0;
+  }
+  if (size > file->data_size) {
+    file_data *f = own_data(file);
+    if (f == NULL) {
+      return ENOMEM;
+    }
+    size_t grown = file->data_size;
+    int err = append_zeros(f, &grown, size);
+    set_size(file, grown);
+    return err;
+  }
+
+  file_data *old = file->data;
+  size_t start = 0;
+  size_t cut = file_extent_at(old->extents, old->count, size, &start);
+  size_t keep = size > start ? cut + 1 : cut;
+
+  file_data *f = calloc(1, sizeof(file_data));
+  if (f == NULL ||
+      (keep > 0 && (f->extents = malloc(keep * sizeof(extent *))) == NULL)) {
+    free(f);
+    return ENOMEM;
+  }
+  f->refs = 1;
+  f->capacity = keep;
+  for (size_t i = 0; i < cut; i++) {
+    f->extents[i] = old->extents[i];
+    __atomic_add_fetch(&f->extents[i]->refs, 1, __ATOMIC_RELAXED);
+  }
+  f->count = cut;
+  f->image = old->image;
+  if (f->image != NULL) {
+    __atomic_add_fetch(&f->image->refs, 1, __ATOMIC_RELAXED);
+  }
+  if (keep > cut) {
+    extent *e = new_extent(old->extents[cut]->capacity);
+    if (e == NULL) {
+      free_data(f);
+      return ENOMEM;
+    }
+    copy_bytes(e->bytes, old->extents[cut], size - start);
+    e->len = (uint32_t)(size - start);
+    f->extents[f->count++] = e;
+  }
+
+  replace_data(file, f, size);
+  return 0;
+}
+
+// Swap each extent only this file holds for what copy makes of it, unless
+// that is NULL. Extents shared with copies or the dedup store are left alone,
+// swapping those would add a copy rather than save one.
+static size_t swap_extents(inode *file, extent *(*copy)(const extent *)) {
+  file_data *f = file->data;
+  size_t freed = 0;
+  if (f == NULL || __atomic_load_n(&f->refs, __ATOMIC_ACQUIRE) != 1) {
+    return 0;
+  }
+  for (size_t i = 0; i < f->count; i++) {
+    extent *e = f->extents[i];
+    if (e->hash != 0 || __atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) != 1) {
+      continue;
+    }
+    extent *swapped = copy(e);
+    if (swapped != NULL) {
+      __atomic_store_n(&f->extents[i], swapped, __ATOMIC_RELEASE);
+      epoch_retire(put_retired_extent, e);
+      freed += extent_memory(e) - extent_memory(swapped);
+    }
+  }
+  return freed;
+}
+
+size_t file_pack(inode *file) { return swap_extents(file, pack_extent); }
+
+size_t file_spill(inode *file) { return swap_extents(file, spill_extent); }
+
+file_data *file_share(const inode *src) {
+  file_data *f = src->data;
+  if (f != NULL) {
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+  }
+  return f;
+}
+
+void file_adopt(inode *dest, file_data *data, size_t size) {
+  replace_data(dest, data, data == NULL ? 0 : size);
+}
+
+void file_drop(file_data *data) {
+  if (data == NULL ||
+      __atomic_sub_fetch(&data->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  epoch_retire(free_data, data);
+}
+
+int file_copy(inode *dest, const inode *src) {
+  // Share the contents, the first write on either side copies the table
+  file_adopt(dest, file_share(src), src->data_size);
+  return 0;
+}
+
+void file_free(inode *file) { replace_data(file, NULL, 0); }
+
+void mapping_put(mapping *image) {
+  if (__atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    stat_add(STAT_PHYSICAL_BYTES, -(uint64_t)image->size);
+    munmap(image->base, image->size);
+    free(image);
+  }
+}
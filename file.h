@@ -0,0 +1,86 @@
+#pragma once
+
+#include "fs.h"
+
+#define EXTENT_MIN_SIZE 64    // Smallest extent allocated by an append
+#define EXTENT_MAX_SIZE 65536 // Extents never grow past this
+
+// Contiguous run of file bytes, with room for capacity bytes. Extents are
+// shared between copies and never written while refs is above one. Reference
+// counts are atomic, parallel cp -r and rm -r take and drop them concurrently.
+typedef struct extent {
+  uint32_t len;
+  uint32_t capacity;
+  uint32_t refs;
+  uint32_t hash;   // Of the bytes if the dedup store holds the extent, else 0
+  uint32_t packed; // Size of the bytes if they are compressed, see pack.h
+  uint32_t spilled; // Slot in the spill file plus one, see spill.h, or 0
+  char bytes[];
+} extent;
+
+// Whether e->bytes holds the bytes as they read
+static inline bool extent_plain(const extent *e) {
+  return e->packed == 0 && e->spilled == 0;
+}
+
+// A loaded snapshot, whose extents file contents use in place. The instance
+// that loaded it and every file_data with extents in it hold a reference, so
+// it stays mapped until the last of them is gone, even if that is freed long
+// after the instance moved on.
+typedef struct mapping {
+  void *base;
+  size_t size;
+  uint32_t refs;
+} mapping;
+
+// File contents, stored in inode->data for S_IFREG inodes. A file that was
+// never written has no file_data at all, which is how cat tells it apart from
+// a file holding an empty string. cp shares the whole file_data, the first
+// write through either side gives that side its own extent table.
+//
+// Readers take no lock, they load count, then extents, then each extent's
+// len, inside an epoch section. Appends write bytes past len and extents past
+// count before moving those, a full extent table is replaced by a bigger
+// copy, and overwrites build a whole new file_data. Positional writes swap
+// the extents they touch for copies in place in the table, so readers load
+// each slot of it as well. Whatever is replaced is retired through the
+// epoch.
+typedef struct file_data {
+  extent **extents;
+  size_t count;
+  size_t capacity;
+  uint32_t refs;
+  mapping *image; // Snapshot some of the extents live in, or NULL
+} file_data;
+
+// An extent with one reference and nothing in it yet, NULL if out of memory
+extent *new_extent(size_t capacity);
+void put_extent(extent *e);
+
+int file_write(inode *file, const char *data, size_t len);
+int file_append(inode *file, const char *data, size_t len);
+// Write at offset, a gap past the end is filled with zeros
+int file_pwrite(inode *file, const char *data, size_t len, size_t offset);
+int file_truncate(inode *file, size_t size);
+// Swap the extents only this file holds for packed copies, see pack.h, or
+// spilled ones, see spill.h. Return how many bytes of memory that freed.
+size_t file_pack(inode *file);
+size_t file_spill(inode *file);
+
+// Position of the extent holding the byte at offset among the first count,
+// count if there is none, and in *start where that extent begins. Only
+// looks at extent lengths, it takes no lock.
+size_t file_extent_at(extent **extents, size_t count, size_t offset,
+                      size_t *start);
+int file_copy(inode *dest, const inode *src);
+
+// file_copy in two steps, so the source can be unlocked before the copy is
+// locked: file_share takes a reference to the contents of src, file_adopt
+// hands it to dest, file_drop gives it back if it ends up unused.
+file_data *file_share(const inode *src);
+void file_adopt(inode *dest, file_data *data, size_t size);
+void file_drop(file_data *data);
+void file_free(inode *file);
+
+// Drop a reference to a snapshot mapping, unmapping it with the last one
+void mapping_put(mapping *image);
@@ -1,31 +1,160 @@
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "dcache.h"
+#include "dir.h"
+#include "epoch.h"
+#include "file.h"
 #include "fs.h"
+#include "pool.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
-_fs fs;
+// Source of instance ids, see dcache_valid
+static uint64_t next_id = 0;
 
-int create_dir(const char *path) {
+// Set by the server for the session whose command runs on this thread
+static _Thread_local inode *thread_dir = NULL;
+
+void use_working_dir(inode *dir) { thread_dir = dir; }
+
+inode *working_dir(_fs *fs) {
+  return thread_dir != NULL && thread_dir->fs == fs ? thread_dir
+                                                    : fs->working_dir;
+}
+
+void lock_inode(inode *node, bool write) {
+  if (write) {
+    pthread_rwlock_wrlock(&node->lock);
+  } else {
+    pthread_rwlock_rdlock(&node->lock);
+  }
+}
+
+static bool try_lock_inode(inode *node, bool write) {
+  int err = write ? pthread_rwlock_trywrlock(&node->lock)
+                  : pthread_rwlock_tryrdlock(&node->lock);
+  return err == 0;
+}
+
+void unlock_inode(inode *node) { pthread_rwlock_unlock(&node->lock); }
+
+static uint32_t generation_of(const inode *node) {
+  return __atomic_load_n(&node->generation, __ATOMIC_ACQUIRE);
+}
+
+// Entries went away, cached lookups may point at inodes about to be freed
+static void note_removal(_fs *fs) {
+  __atomic_add_fetch(&fs->removals, 1, __ATOMIC_SEQ_CST);
+}
+
+void pin_inode(inode *node) {
+  __atomic_add_fetch(&node->reference_count, 1, __ATOMIC_RELAXED);
+}
+
+bool try_pin_inode(inode *node) {
+  uint32_t count = __atomic_load_n(&node->reference_count, __ATOMIC_RELAXED);
+  while (count != 0) {
+    if (__atomic_compare_exchange_n(&node->reference_count, &count, count + 1,
+                                    false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runs once nobody can be looking at the inode any more, see unpin_inode
+static void reclaim_inode(void *arg) {
+  inode *node = arg;
+  if (node->filetype == S_IFDIR) {
+    dir_free(node);
+  } else {
+    file_free(node);
+  }
+  _fs *fs = node->fs;
+  free_inode(fs, node);
+  // Last, the instance may be torn down as soon as it reads zero
+  __atomic_sub_fetch(&fs->unreclaimed, 1, __ATOMIC_RELEASE);
+}
+
+// Drop a reference, freeing the inode with the last one. Lookups that found
+// it before the last link went, and whoever still holds its lock, are all
+// inside epoch sections, so it is only freed once they are done.
+void unpin_inode(inode *node) {
+  if (__atomic_sub_fetch(&node->reference_count, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+  __atomic_add_fetch(&node->fs->unreclaimed, 1, __ATOMIC_RELAXED);
+  epoch_retire(reclaim_inode, node);
+}
+
+static void wait_released(_fs *fs);
+
+void reclaim_fs(_fs *fs) {
+  // Subtrees left to the reaper are unpinned by it, then the same goes as
+  // for the rest: another thread may have picked up some of them and still
+  // be freeing them, or have yet to get to them
+  wait_released(fs);
+  while (__atomic_load_n(&fs->unreclaimed, __ATOMIC_ACQUIRE) > 0) {
+    epoch_synchronize();
+  }
+}
+
+#define NAME_SIZE sizeof(((DIR_ENTRY *)NULL)->name)
+
+// The directory calls take names as C strings, a component is copied into
+// token first. False if it would not fit in an entry.
+static bool name_token(path_view name, char *token) {
+  if (name.len >= NAME_SIZE) {
+    return false;
+  }
+  memcpy(token, name.str, name.len);
+  token[name.len] = '\0';
+  return true;
+}
+
+// Parents are views into the path being created, which is what lets missing
+// ones be created first without copying anything
+static int make_dir(_fs *fs, path_view path) {
   // Take the parent of target creation
-  char *parent = parent_of(path);
+  path_view parent = path_parent(path);
   inode *dir = NULL;
 
   // If the parent of the target does not exist, create it
-  if (resolve_path(parent, &dir) == ENOENT) {
-    create_dir(parent);
+  int err = lock_view(fs, parent, &dir, true);
+  if (err == ENOENT) {
+    unlock_inode(dir);
+    make_dir(fs, parent);
+    err = lock_view(fs, parent, &dir, true);
+  }
+  if (err != 0) {
+    unlock_inode(dir);
+    return err;
   }
 
   // If one of the parents is not a directory, then abbort with ENOTDIR
   if (dir->filetype != S_IFDIR) {
+    unlock_inode(dir);
     return ENOTDIR;
   }
 
+  char name[NAME_SIZE];
+  if (!name_token(path_name(path), name)) {
+    unlock_inode(dir);
+    return ENAMETOOLONG;
+  }
+
   // Allocate a new inode and set its properties properly
-  inode *new_dir = (inode *)malloc(sizeof(inode));
+  inode *new_dir = alloc_inode(fs);
   // Validate memory allocation
   if (new_dir == NULL) {
+    unlock_inode(dir);
     return ENOMEM;
   }
 
@@ -33,64 +162,57 @@ int create_dir(const char *path) {
   new_dir->reference_count = 1;
   new_dir->data_size = 0;
   new_dir->data = NULL;
-  new_dir->sorted = true;
 
-  // Get the name of the target dir from the path
-  char *name = filename(path);
-
-  // Add new directory entry to the parent
-  int err = add_entry(parent, name, new_dir);
-  if (err != 0) {
-    free(new_dir);
-    return err;
+  // Nobody sees the new directory before it is linked, so fill in "." and
+  // ".." first
+  err = dir_insert(new_dir, ".", new_dir);
+  if (err == 0) {
+    err = dir_insert(new_dir, "..", dir);
   }
-
-  // Add itself to the directory list.
-  err = add_entry(path, ".", new_dir);
-  if (err != 0) {
-    return err;
+  if (err == 0) {
+    err = dir_insert(dir, name, new_dir);
   }
-  // Add parent to the directory list, to enable proper traversal.
-  err = add_entry(path, "..", dir);
+  unlock_inode(dir);
+
   if (err != 0) {
-    return err;
+    dir_free(new_dir);
+    free_inode(fs, new_dir);
   }
+  return err;
+}
 
-  // Free temporary variables
-  free(parent);
-  parent = NULL;
-  return 0;
+int create_dir(_fs *fs, const char *path) {
+  TRACE_SPAN(__func__, path);
+  return make_dir(fs, path_of(path));
 }
 
-int create_file(const char *path) {
-  char *parent = parent_of(path);
+int create_file(_fs *fs, const char *path) {
+  TRACE_SPAN(__func__, path);
   inode *dir = NULL;
 
   // Check wether the promised conditions are completed
-  int err = resolve_path(parent, &dir);
+  int err = lock_view(fs, path_parent(path_of(path)), &dir, true);
   if (err != 0) {
+    unlock_inode(dir);
     return err;
   }
 
-  char *name = filename(path);
+  const char *name = filename(path);
   if (dir->filetype != S_IFDIR) {
-    free(parent);
-    parent = NULL;
+    unlock_inode(dir);
     return ENOTDIR;
   }
 
   if (entry_exists(dir, name) != -1) {
-    free(parent);
-    parent = NULL;
+    unlock_inode(dir);
     return EEXIST;
   }
 
   inode *new_file = NULL;
-  new_file = (inode *)malloc(sizeof(inode));
+  new_file = alloc_inode(fs);
   // Memory allocation check
   if (new_file == NULL) {
-    free(parent);
-    parent = NULL;
+    unlock_inode(dir);
     return ENOMEM;
   }
 
@@ -98,67 +220,66 @@ int create_file(const char *path) {
   new_file->reference_count = 1;
   new_file->data_size = 0;
   new_file->data = NULL;
-  new_file->sorted = true;
 
-  err = add_entry(parent, name, new_file);
+  err = dir_insert(dir, name, new_file);
+  unlock_inode(dir);
   if (err != 0) {
-    free(new_file);
+    free_inode(fs, new_file);
     return err;
   }
-  // Free temp vars
-  free(parent);
-  parent = NULL;
   return 0;
 }
 
-int create_hardlink(const char *dest, const char *target) {
-  char *dest_parent = parent_of(dest);
+static int add_entry_at(_fs *fs, path_view path, const char *name,
+                        inode *target);
+
+int create_hardlink(_fs *fs, const char *dest, const char *target) {
+  TRACE_SPAN(__func__, dest);
+  path_view dest_parent = path_parent(path_of(dest));
   inode *parent_dir = NULL;
 
   // Destination validity checks
-  int err = resolve_path(dest_parent, &parent_dir);
+  int err = lock_view(fs, dest_parent, &parent_dir, false);
   if (err != 0) {
+    unlock_inode(parent_dir);
     return err;
   }
 
-  char *dest_name = filename(dest);
+  const char *dest_name = filename(dest);
   if (parent_dir->filetype != S_IFDIR) {
-    return ENOTDIR;
+    err = ENOTDIR;
+  } else if (entry_exists(parent_dir, dest_name) != -1) {
+    err = EEXIST;
   }
-
-  if (entry_exists(parent_dir, dest_name) != -1) {
-    return EEXIST;
+  unlock_inode(parent_dir);
+  if (err != 0) {
+    return err;
   }
 
   // Target validity checks
   inode *target_inode = NULL;
-  err = resolve_path(target, &target_inode);
+  err = lock_path(fs, target, &target_inode, false);
   if (err != 0) {
+    unlock_inode(target_inode);
     return err;
   }
 
-  // Increment hardlink count
-  target_inode->reference_count++;
+  // Increment hardlink count. The new link counts before it exists, which
+  // keeps the target around until it does.
+  pin_inode(target_inode);
+  unlock_inode(target_inode);
 
   // Add entry to parent directory
-  err = add_entry(dest_parent, dest_name, target_inode);
-  if (err != 0) {
-    return err;
-  }
-
-  // Free temp vars
-  free(dest_parent);
-  dest_parent = NULL;
-  return 0;
+  return add_entry_at(fs, dest_parent, dest_name, target_inode);
 }
 
 /* Commented out for debugging
-int create_symlink(const char *dest, const char *target) {
+int create_symlink(_fs *fs, const char *dest, const char *target) {
   char *dest_parent = parent_of(dest);
   inode *parent_dir = NULL;
 
   // Destination validity check
-  int err = resolve_path(dest_parent, &parent_dir);
+  int err = resolve_path(fs, dest_parent, &parent_dir);
   if (err != 0) {
     return err;
   }
@@ -185,7 +306,7 @@ int create_symlink(const char *dest, const char *target) {
   new_file->data = NULL;
 
   // Add the symlink to its parent
-  err = add_entry(dest_parent, dest_name, new_file);
+  err = add_entry(fs, dest_parent, dest_name, new_file);
   if (err != 0) {
     return err;
   }
@@ -196,105 +317,220 @@ int create_symlink(const char *dest, const char *target) {
   return 0;
 } */
 
-int delete_dir(const char *path) {
-  char *parent_path = parent_of(path);
-  inode *parent_inode = NULL;
+static void release(inode *node);
 
-  // Path validation
-  int err = resolve_path(parent_path, &parent_inode);
-  if (err != 0) {
-    free(parent_path);
-    return err;
+// Split off subtrees are walked outside the section of the thread that
+// spawned them
+static void release_task(void *arg) {
+  TRACE_SPAN(__func__, NULL);
+  epoch_enter();
+  release(arg);
+  epoch_exit();
+}
+
+// Empty a directory that lost a link, dropping the link of every entry in it.
+// Subdirectories are emptied before their own link goes, like deleting them
+// one by one would, and are handed to idle workers when there are any.
+static void release_entries(inode *dir) {
+  // Once the entries are out, locked lookups that were already on their way
+  // in, or come back up through "..", find nothing left to reach. Lock-free
+  // ones may still be on the old table, it is retired rather than freed.
+  lock_inode(dir, true);
+  directory *entries = dir_detach(dir);
+  unlock_inode(dir);
+  if (entries == NULL) {
+    return;
+  }
+  note_removal(dir->fs);
+
+  for (size_t i = 2; i < entries->count; i++) {
+    inode *item = entries->entries[i].item;
+    if (item == NULL) {
+      continue;
+    }
+    if (item->filetype == S_IFDIR && pool_wants_work()) {
+      pool_spawn(release_task, item);
+    } else {
+      release(item);
+    }
   }
+  dir_retire(entries);
+}
 
-  inode *directory = NULL;
-  err = resolve_path(path, &directory);
-  if (err != 0) {
-    free(parent_path);
-    return err;
+static void release_entries_task(void *arg) { release_entries(arg); }
+
+static void release(inode *node) {
+  if (node->filetype == S_IFDIR) {
+    release_entries(node);
   }
+  unpin_inode(node);
+}
 
-  // Recursively delete all subentities
-  while (directory->data_size / sizeof(DIR_ENTRY) > 2) {
-    char *dir = append(path, "/");
-    char *appended = append(dir, ((DIR_ENTRY *)directory->data)[2].name);
-    err = delete_g(appended);
-    free(dir);
-    free(appended);
-    appended = NULL;
-    if (err != 0) {
-      free(parent_path);
-      return err;
+// Directories unlinked with at least this many entries are released in the
+// background, see defer_release
+#define RELEASE_DEFER_ENTRIES 16
+// Subtrees the reaper may have queued before unlinking waits for it again
+#define RELEASE_QUEUE_MAX 8
+
+typedef struct release_job {
+  inode *node;
+  struct release_job *next;
+} release_job;
+
+// One reaper thread for every instance, started with the first subtree it
+// gets. It releases them one by one outside the pool, which is left to the
+// commands, and each instance counts in unreleased those still queued or
+// being released, for reclaim_fs to wait on.
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work; // A job was queued
+  pthread_cond_t done; // A job was finished
+  bool started;
+  size_t queued;
+  release_job *head;
+  release_job *tail;
+} reaper = {.lock = PTHREAD_MUTEX_INITIALIZER,
+            .work = PTHREAD_COND_INITIALIZER,
+            .done = PTHREAD_COND_INITIALIZER};
+
+static void *reaper_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&reaper.lock);
+  for (;;) {
+    while (reaper.head == NULL) {
+      pthread_cond_wait(&reaper.work, &reaper.lock);
     }
-  }
+    release_job *job = reaper.head;
+    reaper.head = job->next;
+    if (reaper.head == NULL) {
+      reaper.tail = NULL;
+    }
+    pthread_mutex_unlock(&reaper.lock);
 
-  // Decrement element count
-  directory->reference_count--;
+    _fs *fs = job->node->fs;
+    release_task(job->node);
+    free(job);
 
-  // If through this deletion, the count reaches 0, deallocate inode
-  // It could however still be hardlinked elsewhere so check before
-  // nuking the data from memory
-  if (directory->reference_count == 0) {
-    free(directory->data);
-    directory->data = NULL;
-    free(directory);
-    directory = NULL;
+    pthread_mutex_lock(&reaper.lock);
+    reaper.queued--;
+    fs->unreleased--;
+    pthread_cond_broadcast(&reaper.done);
   }
+  return NULL;
+}
 
-  // Either way, we need to remove this element from the parent dir
-  err = remove_entry(parent_path, filename(path));
-  if (err != 0) {
-    free(parent_path);
-    parent_path = NULL;
-    return err;
+// Leave a big unlinked subtree to the reaper, so rm -r returns as soon as it
+// is out of the tree. Only done when there is a spare CPU for it, and while
+// the reaper keeps up, otherwise the caller releases it as before.
+static bool defer_release(_fs *fs, inode *node) {
+  if (pool_threads() < 2 || node->filetype != S_IFDIR) {
+    return false;
+  }
+  // Commands that got in before the unlink may still be changing it
+  lock_inode(node, false);
+  size_t entries = dir_count(node);
+  unlock_inode(node);
+  if (entries < RELEASE_DEFER_ENTRIES) {
+    return false;
+  }
+  release_job *job = malloc(sizeof(release_job));
+  if (job == NULL) {
+    exit(ENOMEM);
   }
+  job->node = node;
+  job->next = NULL;
 
-  // Free temporary variables
-  free(parent_path);
-  parent_path = NULL;
-  return 0;
+  pthread_mutex_lock(&reaper.lock);
+  if (!reaper.started) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reaper_main, NULL) != 0) {
+      pthread_mutex_unlock(&reaper.lock);
+      free(job);
+      return false;
+    }
+    pthread_detach(thread);
+    reaper.started = true;
+  }
+  if (reaper.queued >= RELEASE_QUEUE_MAX) {
+    pthread_mutex_unlock(&reaper.lock);
+    free(job);
+    return false;
+  }
+  if (reaper.tail == NULL) {
+    reaper.head = job;
+  } else {
+    reaper.tail->next = job;
+  }
+  reaper.tail = job;
+  reaper.queued++;
+  fs->unreleased++;
+  pthread_cond_signal(&reaper.work);
+  pthread_mutex_unlock(&reaper.lock);
+  stat_add(STAT_RELEASES_DEFERRED, 1);
+  return true;
+}
+
+static void wait_released(_fs *fs) {
+  pthread_mutex_lock(&reaper.lock);
+  while (fs->unreleased > 0) {
+    pthread_cond_wait(&reaper.done, &reaper.lock);
+  }
+  pthread_mutex_unlock(&reaper.lock);
 }
 
-int delete_file(const char *path) {
-  inode *file = NULL;
+// Unlink path from its parent, then release what it pointed to. Unlinking
+// comes first so no new lookup can get into a subtree being torn down.
+static int unlink_path(_fs *fs, const char *path) {
+  TRACE_SPAN(__func__, path);
+  inode *parent = NULL;
 
-  // Check for potential errors
-  int err = resolve_path(path, &file);
+  // Path validation
+  int err = lock_view(fs, path_parent(path_of(path)), &parent, true);
   if (err != 0) {
+    unlock_inode(parent);
     return err;
   }
 
-  // Again decrease count of hardlinks
-  file->reference_count--;
-
-  // If hardlink count is 0, nuke the data
-  if (file->reference_count == 0) {
-    free(file->data);
-    file->data = NULL;
-    free(file);
-    file = NULL;
-  }
+  int index = parent->filetype == S_IFDIR ? dir_lookup(parent, filename(path))
+                                          : -1;
+  if (index == -1) {
+    unlock_inode(parent);
 
-  // Remove entry from parent directory anyway
-  char *parent = parent_of(path);
-  err = remove_entry(parent, filename(path));
-  if (err != 0) {
-    free(parent);
-    parent = NULL;
+    // "/" and paths ending in a slash do not name their entry, such a
+    // directory only gets emptied. Nothing unlinks it, so it needs no pin.
+    inode *target = NULL;
+    err = lock_path(fs, path, &target, false);
+    unlock_inode(target);
+    if (err == 0 && target->filetype == S_IFDIR) {
+      pool_run(release_entries_task, target);
+    }
     return err;
   }
 
-  free(parent);
-  parent = NULL;
+  inode *target = dir_table(parent)->entries[index].item;
+  dir_remove(parent, filename(path));
+  note_removal(fs);
+  unlock_inode(parent);
+
+  // Release everything below it, in parallel when the pool has workers
+  if (!defer_release(fs, target)) {
+    pool_run(release_task, target);
+  }
   return 0;
 }
 
-int delete_g(const char *path /*, bool recursive */) { // Param deleted for
+int delete_dir(_fs *fs, const char *path) { return unlink_path(fs, path); }
+
+int delete_file(_fs *fs, const char *path) { return unlink_path(fs, path); }
+
+int delete_g(_fs *fs,
+             const char *path /*, bool recursive */) { // Param deleted for
                                                        // error suppression
+  TRACE_SPAN(__func__, path);
   inode *target = NULL;
 
   // Error checking for path validation
-  int err = resolve_path(path, &target);
+  int err = resolve_path(fs, path, &target);
   if (err != 0) {
     return err;
   }
@@ -303,312 +539,418 @@ int delete_g(const char *path /*, bool recursive */) { // Param deleted for
   // Given the specification, recursive will always be true
   // But too late, I am not refactoring this
   if (target->filetype == S_IFDIR) {
-    delete_dir(path);
+    delete_dir(fs, path);
   } else {
     // Attempt to fix valgrind issue
-    delete_file(path);
+    delete_file(fs, path);
   }
 
   return 0;
 }
 
-int write_file(const char *path, char *data) {
+int write_file(_fs *fs, const char *path, const char *data, size_t len) {
+  TRACE_SPAN(__func__, path);
   inode *target = NULL;
 
   // Error checking
-  int err = resolve_path(path, &target);
-  if (err != 0) {
-    return err;
-  }
-
-  if (target->filetype == S_IFDIR) {
-    return EISDIR;
+  int err = lock_path(fs, path, &target, true);
+  if (err == 0 && target->filetype == S_IFDIR) {
+    err = EISDIR;
   }
 
   // Overwrite the existing data
-  target->data_size = strlen(data) + 1;
-  free(target->data);
-  target->data = NULL;
-  target->data = malloc(target->data_size);
-  memset(target->data, 0, target->data_size);
-  if (target->data == NULL) {
-    return ENOMEM;
+  if (err == 0) {
+    err = file_write(target, data, len);
   }
-
-  // Copy the current text into the inode data field
-  strcpy((char *)target->data, data);
-
-  return 0;
+  unlock_inode(target);
+  return err;
 }
 
-int append_file(const char *path, const char *data) {
+int append_file(_fs *fs, const char *path, const char *data, size_t len) {
+  TRACE_SPAN(__func__, path);
   inode *target = NULL;
 
   // Error checking
-  int err = resolve_path(path, &target);
+  int err = lock_path(fs, path, &target, true);
+  if (err == 0 && target->filetype == S_IFDIR) {
+    err = EISDIR;
+  }
 
-  if (err != 0) {
-    return err;
+  if (err == 0) {
+    err = file_append(target, data, len);
   }
+  unlock_inode(target);
+  return err;
+}
 
-  if (target->filetype == S_IFDIR) {
-    return EISDIR;
+int pwrite_file(_fs *fs, const char *path, size_t offset, const char *data,
+                size_t len) {
+  TRACE_SPAN(__func__, path);
+  inode *target = NULL;
+  int err = lock_path(fs, path, &target, true);
+  if (err == 0 && target->filetype == S_IFDIR) {
+    err = EISDIR;
+  }
+  if (err == 0) {
+    err = file_pwrite(target, data, len, offset);
   }
+  unlock_inode(target);
+  return err;
+}
 
-  if (target->data_size == 0 || target->data == NULL) {
-    target->data_size = strlen(data) + 1;
-    target->data = malloc(target->data_size);
-    if (target->data == NULL) {
-      return ENOMEM; // Handle malloc failure
-    }
-    strcpy(target->data, data);
-    return 0;
+int truncate_file(_fs *fs, const char *path, size_t size) {
+  TRACE_SPAN(__func__, path);
+  inode *target = NULL;
+  int err = lock_path(fs, path, &target, true);
+  if (err == 0 && target->filetype == S_IFDIR) {
+    err = EISDIR;
+  }
+  if (err == 0) {
+    err = file_truncate(target, size);
   }
+  unlock_inode(target);
+  return err;
+}
 
-  size_t old_size = target->data_size;
-  size_t data_len = strlen(data);
-  target->data_size += data_len;
+static int add_entry_at(_fs *fs, path_view path, const char *name,
+                        inode *target) {
+  TRACE_SPAN_N("add_entry", path.str, path.len);
+  inode *dir = NULL;
 
-  char *new_data = realloc(target->data, target->data_size);
-  if (new_data == NULL) {
-    return ENOMEM; // Handle realloc failure
+  // Error checking
+  int err = lock_view(fs, path, &dir, true);
+  if (err == 0 && dir->filetype != S_IFDIR) {
+    err = ENOTDIR;
   }
-  target->data = new_data;
 
-  strcpy(target->data + old_size - 1,
-         data); // Append at the end (before null terminator)
-  ((char *)target->data)[target->data_size - 1] =
-      '\0'; // Ensure null termination
+  if (err == 0) {
+    err = dir_insert(dir, name, target);
+  }
+  unlock_inode(dir);
+  return err;
+}
 
-  return 0;
+int add_entry(_fs *fs, const char *path, const char *name, inode *target) {
+  return add_entry_at(fs, path_of(path), name, target);
 }
 
-int add_entry(const char *path, const char *name, inode *target) {
-  inode *dir = NULL;
+int remove_entry(_fs *fs, const char *path, const char *name) {
+  TRACE_SPAN(__func__, path);
+  inode *target = NULL;
 
   // Error checking
-  int err = resolve_path(path, &dir);
-  if (err != 0) {
-    return err;
+  int err = lock_path(fs, path, &target, true);
+  if (err == 0 && target->filetype != S_IFDIR) {
+    err = ENOTDIR;
   }
 
-  if (dir->filetype != S_IFDIR) {
-    return ENOTDIR;
+  // A missing entry is not an error, the name is simply already gone
+  if (err == 0 && dir_remove(target, name) == 0) {
+    note_removal(fs);
   }
+  unlock_inode(target);
+  return err;
+}
 
-  if (name[0] != '.') {
-    dir->sorted = false;
-  }
+// Moves are serialized, so nothing else can move either end meanwhile. The
+// entry is unlinked before it is linked again, never holding both parents.
+// fs->renames is odd for as long as it runs, see resolve_path.
+int move_entry(_fs *fs, const char *src, const char *dest) {
+  TRACE_SPAN(__func__, src);
+  pthread_mutex_lock(&fs->rename_lock);
+  __atomic_add_fetch(&fs->renames, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
 
-  void *data_copy = dir->data;
-  // Reallocate proper size
-  dir->data_size += sizeof(DIR_ENTRY);
-  dir->data = realloc(dir->data, dir->data_size);
-  // Memory realloc check
-  if (dir->data == NULL) {
-    free(data_copy);
-    data_copy = NULL;
-    return ENOMEM;
+  inode *dir = NULL;
+  int err = lock_view(fs, path_parent(path_of(src)), &dir, true);
+  if (err == 0 && dir->filetype != S_IFDIR) {
+    err = ENOTDIR;
   }
 
-  // Add entry (yes this looks absolutely horendous) and apparently worked
-  // horrendously too, due to allocating over previously used space which led to
-  // what can only be qualified as crimes against humanity
-  strcpy(((DIR_ENTRY *)dir->data)[dir->data_size / sizeof(DIR_ENTRY) - 1].name,
-         name);
-  ((DIR_ENTRY *)dir->data)[dir->data_size / sizeof(DIR_ENTRY) - 1].item =
-      target;
+  int index = err == 0 ? dir_lookup(dir, filename(src)) : -1;
+  if (err == 0 && index == -1) {
+    err = ENOENT;
+  }
+  inode *target = NULL;
+  if (err == 0) {
+    target = dir_table(dir)->entries[index].item;
+    dir_remove(dir, filename(src));
+    note_removal(fs);
+  }
+  unlock_inode(dir);
 
-  if (dir->sorted == false) {
-    qsort(dir->data + (sizeof(DIR_ENTRY) * 2),
-          dir->data_size / sizeof(DIR_ENTRY) - 2, sizeof(DIR_ENTRY),
-          compare_entries);
-    dir->sorted = true;
+  if (err == 0) {
+    path_view dest_parent = path_parent(path_of(dest));
+    err = add_entry_at(fs, dest_parent, filename(dest), target);
   }
 
-  return 0;
+  __atomic_add_fetch(&fs->renames, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&fs->rename_lock);
+  return err;
 }
 
-int remove_entry(const char *path, const char *name) {
-  inode *target = NULL;
+int entry_exists(inode *dir, const char *name) {
+  return dir_lookup(dir, name);
+}
 
-  // Error checking
-  int err = resolve_path(path, &target);
-  if (err != 0) {
-    return err;
-  }
+path_view path_of(const char *path) { return (path_view){path, strlen(path)}; }
 
-  // Iterate over entries
-  for (size_t i = 2; i < target->data_size / sizeof(DIR_ENTRY); i++) {
-    // If names match, delete entry, then reallocate the array to reflect
-    // current size
-    if (strcmp(((DIR_ENTRY *)target->data)[i].name, name) == 0) {
-      target->sorted = false;
-      ((DIR_ENTRY *)target->data)[i] =
-          ((DIR_ENTRY *)
-               target->data)[target->data_size / sizeof(DIR_ENTRY) - 1];
-      target->data_size -= sizeof(DIR_ENTRY);
-
-      void *old_data = target->data;
-      target->data = realloc(target->data, target->data_size);
-      // If reallocation fails, then return ENOMEM
-      if (target->data == NULL) {
-        free(old_data);
-        old_data = NULL;
-        return ENOMEM;
-      }
-    }
+bool path_next(path_view *rest, path_view *component) {
+  while (rest->len > 0 && rest->str[0] == '/') {
+    rest->str++;
+    rest->len--;
   }
-
-  if (target->sorted == false) {
-    qsort(target->data + (sizeof(DIR_ENTRY) * 2),
-          target->data_size / sizeof(DIR_ENTRY) - 2, sizeof(DIR_ENTRY),
-          compare_entries);
+  if (rest->len == 0) {
+    return false;
   }
-
-  return 0;
+  const char *slash = memchr(rest->str, '/', rest->len);
+  size_t len = slash == NULL ? rest->len : (size_t)(slash - rest->str);
+  *component = (path_view){rest->str, len};
+  rest->str += len;
+  rest->len -= len;
+  return true;
 }
 
-int entry_exists(inode *dir, const char *name) {
-  size_t low = 0;
-  size_t high = dir->data_size / sizeof(DIR_ENTRY) - 1;
+// One attempt at resolving a path, hand over hand: the next inode is locked
+// before the current one is let go, so nothing on the way can be freed under
+// us. Only the last inode is locked for writing, when asked. Going up through
+// ".." or upgrading a lock means letting go first, EAGAIN says something
+// changed meanwhile and the walk has to start over.
+static int walk_path(inode *start, path_view path, bool write,
+                     inode **result, inode **miss_dir) {
+  path_view component;
+  bool more = path_next(&path, &component);
+  inode *node = start;
+  lock_inode(node, write && !more);
+  *result = node;
+
+  char token[NAME_SIZE];
+  while (more) {
+    // Check wether current node is a directory
+    // Otherwise, path is invalid, since by this point it is evident that there
+    // are further tokens
+    if (node->filetype != S_IFDIR) {
+      return ENOTDIR;
+    }
 
-  while (low <= high) {
-    size_t mid = low + (high - low) / 2;
+    // Figure out wether the next node actually exists.
+    // Otherwise return the fact that this directory does not exist
+    stat_add(STAT_COMPONENTS, 1);
+    int index = -1;
+    if (name_token(component, token)) {
+      index = entry_exists(node, token);
+    }
+    if (index == -1) {
+      *miss_dir = node;
+      return ENOENT;
+    }
 
-    DIR_ENTRY *mid_element = &((DIR_ENTRY *)dir->data)[mid];
+    inode *next = dir_table(node)->entries[index].item;
+    more = path_next(&path, &component);
+    bool next_write = write && !more;
+
+    if (next == node) { // "." and the root's ".."
+      if (next_write) {
+        uint32_t generation = generation_of(node);
+        unlock_inode(node);
+        lock_inode(node, true);
+        if (generation_of(node) != generation) {
+          unlock_inode(node);
+          return EAGAIN;
+        }
+      }
+      continue;
+    }
 
-    int comparison = strcmp(name, mid_element->name);
-    if (comparison == 0) {
-      return mid;
-    } else if (comparison > 0) {
-      low = mid + 1;
+    bool locked = try_lock_inode(next, next_write);
+    if (!locked && index >= 2) {
+      // Down the tree, waiting with the parent held keeps the lock order
+      lock_inode(next, next_write);
+      locked = true;
+    }
+    if (locked) {
+      unlock_inode(node);
     } else {
-      high = mid - 1;
+      // Up through "..", let go first so the lock order is never reversed
+      uint32_t generation = generation_of(next);
+      unlock_inode(node);
+      lock_inode(next, next_write);
+      if (generation_of(next) != generation) {
+        unlock_inode(next);
+        return EAGAIN;
+      }
     }
+
+    // Set the new current dir to the inode that is the result
+    node = next;
+    *result = node;
   }
 
-  return -1;
+  return 0;
 }
 
 // TODO: Implement the actual symlink logic, because as of now, this only
 // traverses directories.
-int resolve_path(const char *path, inode **result) {
+int lock_path(_fs *fs, const char *path, inode **result, bool write) {
+  return lock_view(fs, path_of(path), result, write);
+}
+
+int lock_view(_fs *fs, path_view path, inode **result, bool write) {
+  TRACE_SPAN_N(__func__, path.str, path.len);
   // Check whether path begins at root, or if it is a relative path.
-  if (path[0] == '/') {
-    *result = fs.root;
-  } else {
-    *result = fs.working_dir; // Otherwise set it to the current WD
+  inode *start = path.len > 0 && path.str[0] == '/' ? fs->root
+                                                    : working_dir(fs);
+  stat_add(STAT_LOCK_PATH_CALLS, 1);
+
+  // Operations tend to resolve the same paths over and over. Nothing can be
+  // freed while it is locked, so an entry still valid once its result is
+  // locked can be trusted.
+  const dcache_entry *cached = dcache_lookup(fs, start, path.str, path.len);
+  if (cached != NULL) {
+    lock_inode(cached->result, write && cached->err == 0);
+    if (dcache_valid(fs, cached)) {
+      *result = cached->result;
+      return cached->err;
+    }
+    unlock_inode(cached->result);
   }
 
-  char *path_copy = (char *)malloc(strlen(path) + 1);
-  if (path_copy == NULL) {
-    free(path_copy);
-    path_copy = NULL;
-    return ENOMEM;
+  int err = EAGAIN;
+  inode *miss_dir = NULL;
+  uint64_t removals = 0;
+  while (err == EAGAIN) {
+    removals = __atomic_load_n(&fs->removals, __ATOMIC_SEQ_CST);
+    miss_dir = NULL;
+    err = walk_path(start, path, write, result, &miss_dir);
   }
 
-  memset(path_copy, 0, strlen(path) + 1);
+  dcache_insert(fs, start, path.str, path.len, removals, *result, err,
+                miss_dir);
+  return err;
+}
 
-  strcpy(path_copy, path);
+// Sorting publishes a sorted copy of the table, a change like any other that
+// needs the lock for writing. Sorted directories cost a single load.
+void sort_dir(inode *dir) {
+  if (dir->filetype != S_IFDIR || dir_sorted(dir)) {
+    return;
+  }
+  lock_inode(dir, true);
+  dir_sort(dir);
+  unlock_inode(dir);
+}
 
-  char *token = strtok(path_copy, "/");
-  while (token != NULL) {
-    // Check wether current node is a directory
-    // Otherwise, path is invalid, since by this point it is evident that there
-    // are further tokens
-    if ((*result)->filetype != S_IFDIR) {
-      free(path_copy);
-      path_copy = NULL;
+// One attempt at resolving a path without any lock. Whatever the walk finds
+// stays allocated until the caller's epoch section ends, though it may be
+// unlinked meanwhile, like it would have been right after a locked lookup.
+static int lookup_path(inode *start, path_view path, inode **result,
+                       inode **miss_dir) {
+  inode *node = start;
+  *result = node;
+
+  char token[NAME_SIZE];
+  path_view component;
+  while (path_next(&path, &component)) {
+    if (node->filetype != S_IFDIR) {
       return ENOTDIR;
     }
 
-    // Figure out wether the next node actually exists.
-    // Otherwise return the fact that this directory does not exist
-    int tok_index = entry_exists(*result, token);
-    if (tok_index == -1) {
-      free(path_copy);
-      path_copy = NULL;
+    stat_add(STAT_COMPONENTS, 1);
+    inode *next = NULL;
+    if (name_token(component, token)) {
+      next = dir_find(node, token);
+    }
+    if (next == NULL) {
+      *miss_dir = node;
       return ENOENT;
     }
 
-    // Set the new current dir to the inode that is the result
-    *result = ((DIR_ENTRY *)(*result)->data)[tok_index].item;
-
-    // Get the new token in order
-    token = strtok(NULL, "/");
+    node = next;
+    *result = node;
   }
 
-  // If we got to this point, we have resolved the path.
-  free(path_copy);
-  path_copy = NULL;
   return 0;
 }
 
-char *parent_of(const char *path) {
-  char *last_tok = strrchr(path, '/');
-  if (last_tok == NULL) {
-    char *current_dir = malloc(2);
-    if (current_dir == NULL) {
-      exit(ENOMEM);
-    }
-    memset(current_dir, 0, 2);
-    current_dir[0] = '.';
-    current_dir[1] = '\0';
-    return current_dir;
-  }
+// Lookups only ever read: a move during the walk could make it see a path
+// that never existed, so it starts over when fs->renames says one happened.
+int resolve_path(_fs *fs, const char *path, inode **result) {
+  return resolve_view(fs, path_of(path), result);
+}
 
-  if (last_tok == path && path[0] == '/') { // Handle root directory
-    char *root_copy = malloc(2); // Allocate space for "/" and null terminator
-    if (root_copy == NULL) {
-      exit(ENOMEM);
+int resolve_view(_fs *fs, path_view path, inode **result) {
+  TRACE_SPAN_N(__func__, path.str, path.len);
+  inode *start = path.len > 0 && path.str[0] == '/' ? fs->root
+                                                    : working_dir(fs);
+  stat_add(STAT_RESOLVE_CALLS, 1);
+
+  const dcache_entry *cached = dcache_lookup(fs, start, path.str, path.len);
+  if (cached != NULL) {
+    stat_add(STAT_RESOLVE_CACHED, 1);
+    *result = cached->result;
+    return cached->err;
+  }
+
+  int err = 0;
+  inode *miss_dir = NULL;
+  uint64_t removals = 0;
+  for (;;) {
+    uint64_t renames = __atomic_load_n(&fs->renames, __ATOMIC_ACQUIRE);
+    if (renames & 1) {
+      sched_yield();
+      continue;
     }
-    memset(root_copy, 0, 2);
-    root_copy[0] = '/';
-    root_copy[1] = '\0';
-    return root_copy;
-  }
+    removals = __atomic_load_n(&fs->removals, __ATOMIC_SEQ_CST);
+    miss_dir = NULL;
+    err = lookup_path(start, path, result, &miss_dir);
 
-  char *copy = (char *)malloc((size_t)(last_tok - path) + 1);
-  if (copy == NULL) {
-    exit(ENOMEM);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&fs->renames, __ATOMIC_RELAXED) == renames) {
+      break;
+    }
   }
-  memset(copy, 0, (size_t)(last_tok - path) + 1);
-
-  memcpy(copy, path, (size_t)(last_tok - path));
-  copy[last_tok - path] = '\0';
 
-  return copy;
+  dcache_insert(fs, start, path.str, path.len, removals, *result, err,
+                miss_dir);
+  return err;
 }
 
-char *filename(const char *path) {
-  char *last_tok = strrchr(path, '/');
-  if (last_tok) {
-    return last_tok + 1;
+static const char *last_slash(path_view path) {
+  for (size_t i = path.len; i > 0; i--) {
+    if (path.str[i - 1] == '/') {
+      return &path.str[i - 1];
+    }
   }
-  return (char *)path;
+  return NULL;
 }
 
-char *append(const char *path, const char *name) {
-  const size_t len1 = strlen(path);
-  const size_t len2 = strlen(name);
-  char *result = malloc(len1 + len2 + 1);
-  memset(result, 0, len1 + len2 + 1);
-
-  if (result == NULL) {
-    exit(ENOMEM);
+path_view path_parent(path_view path) {
+  const char *last = last_slash(path);
+  if (last == NULL) {
+    return (path_view){".", 1};
+  }
+  if (last == path.str) { // Handle root directory
+    return (path_view){"/", 1};
   }
+  return (path_view){path.str, (size_t)(last - path.str)};
+}
 
-  memcpy(result, path, len1);
-  memcpy(result + len1, name, len2 + 1);
-  return result;
+path_view path_name(path_view path) {
+  const char *last = last_slash(path);
+  if (last == NULL) {
+    return path;
+  }
+  return (path_view){last + 1, path.len - (size_t)(last + 1 - path.str)};
 }
 
-int copy_file(const char *src, const char *dest) {
+const char *filename(const char *path) { return path_name(path_of(path)).str; }
+
+int copy_file(_fs *fs, const char *src, const char *dest) {
+  TRACE_SPAN(__func__, src);
   inode *dest_file = NULL;
-  int err = resolve_path(dest, &dest_file);
+  int err = resolve_path(fs, dest, &dest_file);
   if (err == 0) {
-    err = delete_g(dest);
+    err = delete_g(fs, dest);
     if (err != 0) {
       return err;
     }
@@ -616,145 +958,258 @@ int copy_file(const char *src, const char *dest) {
     return err;
   }
 
-  err = create_file(dest);
-  if (err != 0) {
-    return err;
-  }
-  err = resolve_path(dest, &dest_file);
+  err = create_file(fs, dest);
   if (err != 0) {
     return err;
   }
 
+  // Never hold both at once: take a reference to the source contents, then
+  // hand it to the copy
   inode *src_file = NULL;
-  err = resolve_path(src, &src_file);
+  err = lock_path(fs, src, &src_file, false);
+  file_data *data = err == 0 ? file_share(src_file) : NULL;
+  size_t size = src_file->data_size;
+  unlock_inode(src_file);
   if (err != 0) {
     return err;
   }
 
-  dest_file->data_size = src_file->data_size;
-  dest_file->data = malloc(dest_file->data_size);
-  memcpy(dest_file->data, src_file->data, dest_file->data_size);
+  err = lock_path(fs, dest, &dest_file, true);
+  if (err == 0) {
+    file_adopt(dest_file, data, size);
+  } else {
+    file_drop(data);
+  }
+  unlock_inode(dest_file);
+  return err;
+}
+
+// State shared by every task of one cp -r
+typedef struct copy_op {
+  _fs *fs;
+  inode *top;
+  int err; // Last error any task ran into
+} copy_op;
+
+// Fill dest_dir with a copy of src_dir, on whichever worker picks it up
+typedef struct copy_job {
+  inode *src_dir;
+  inode *dest_dir;
+  copy_op *op;
+} copy_job;
+
+static int copy_entries(inode *src_dir, inode *dest_dir, copy_op *op);
+
+// Subdirectories handed to other workers are pinned until they are done
+static void copy_task(void *arg) {
+  TRACE_SPAN(__func__, NULL);
+  copy_job *job = arg;
+  epoch_enter();
+  lock_inode(job->src_dir, false);
+  lock_inode(job->dest_dir, true);
+  int err = copy_entries(job->src_dir, job->dest_dir, job->op);
+  unlock_inode(job->dest_dir);
+  unlock_inode(job->src_dir);
+  unpin_inode(job->dest_dir);
+  unpin_inode(job->src_dir);
+  epoch_exit();
 
-  return 0;
+  if (err != 0) {
+    __atomic_store_n(&job->op->err, err, __ATOMIC_RELAXED);
+  }
+  free(job);
 }
 
-int copy_dir(const char *src, const char *dest) {
-  int err = create_dir(dest);
+// The top of the copy, locked by copy_dir
+static void copy_top_task(void *arg) {
+  copy_job *job = arg;
+  int err = copy_entries(job->src_dir, job->dest_dir, job->op);
   if (err != 0) {
-    return err;
+    __atomic_store_n(&job->op->err, err, __ATOMIC_RELAXED);
   }
+}
 
-  inode *dest_dir = NULL;
-  err = resolve_path(dest, &dest_dir);
-  if (err != 0 || dest_dir == NULL) {
-    return err != 0 ? err : ENOENT;
+// Copy every entry of src_dir into dest_dir, walking inodes instead of paths.
+// op->top is the directory the copy started in, it is skipped wherever it
+// shows up so copying a directory into its own subtree terminates. Each
+// destination directory is filled by a single task, in source order, so the
+// result does not depend on how subdirectories get split among workers.
+// src_dir is locked for reading and dest_dir for writing by the caller.
+static int copy_entries(inode *src_dir, inode *dest_dir, copy_op *op) {
+  directory *d = dir_table(src_dir);
+  for (size_t i = 2; i < dir_used(d); i++) {
+    DIR_ENTRY entry = d->entries[i];
+    if (entry.item == NULL || entry.item == op->top) {
+      continue;
+    }
+
+    inode *item = alloc_inode(op->fs);
+    if (item == NULL) {
+      return ENOMEM;
+    }
+    item->filetype = entry.item->filetype;
+    item->reference_count = 1;
+
+    // File data is shared copy on write, directories get their own entries
+    int err = 0;
+    if (item->filetype == S_IFDIR) {
+      err = dir_insert(item, ".", item);
+      if (err == 0) {
+        err = dir_insert(item, "..", dest_dir);
+      }
+    } else {
+      lock_inode(entry.item, false);
+      err = file_copy(item, entry.item);
+      unlock_inode(entry.item);
+    }
+
+    if (err == 0) {
+      err = dir_insert(dest_dir, entry.name, item);
+    }
+    if (err != 0) {
+      if (item->filetype == S_IFDIR) {
+        dir_free(item);
+      } else {
+        file_free(item);
+      }
+      free_inode(op->fs, item);
+      return err;
+    }
+
+    if (item->filetype != S_IFDIR) {
+      continue;
+    }
+    if (pool_wants_work()) {
+      copy_job *job = malloc(sizeof(copy_job));
+      if (job == NULL) {
+        exit(ENOMEM);
+      }
+      *job = (copy_job){entry.item, item, op};
+      pin_inode(entry.item);
+      pin_inode(item);
+      pool_spawn(copy_task, job);
+      continue;
+    }
+    lock_inode(entry.item, false);
+    lock_inode(item, true);
+    err = copy_entries(entry.item, item, op);
+    unlock_inode(item);
+    unlock_inode(entry.item);
+    if (err != 0) {
+      return err;
+    }
   }
 
-  inode *src_dir = NULL;
-  err = resolve_path(src, &src_dir);
-  if (err != 0 || src_dir == NULL) {
-    return err != 0 ? err : ENOENT;
+  return 0;
+}
+
+// Serialized with moves, a copy holds locks on both sides all along
+int copy_dir(_fs *fs, const char *src, const char *dest) {
+  TRACE_SPAN(__func__, src);
+  pthread_mutex_lock(&fs->rename_lock);
+  int err = create_dir(fs, dest);
+  if (err != 0) {
+    pthread_mutex_unlock(&fs->rename_lock);
+    return err;
   }
 
-  char *parent = parent_of(dest);
-  inode *parent_dir = NULL;
-  err = resolve_path(parent, &parent_dir);
-  if (err != 0 || parent_dir == NULL) {
-    return err != 0 ? err : ENOENT;
+  inode *src_dir = NULL;
+  err = lock_path(fs, src, &src_dir, false);
+  if (err != 0) {
+    unlock_inode(src_dir);
+    pthread_mutex_unlock(&fs->rename_lock);
+    return err;
   }
 
-  for (size_t i = 2; i < src_dir->data_size / sizeof(DIR_ENTRY); i++) {
-    char *src_buf = NULL;
-    char *src_file = NULL;
-    char *dst_buf = NULL;
-    char *dst_file = NULL;
-
-    src_buf = append(src, "/");
-    dst_buf = append(dest, "/");
-    src_file = append(src_buf, ((DIR_ENTRY *)src_dir->data)[i].name);
-    dst_file = append(dst_buf, ((DIR_ENTRY *)src_dir->data)[i].name);
-
-    if (src_file == NULL || dst_file == NULL) {
-      free(src_buf);
-      src_buf = NULL;
-      free(dst_buf);
-      dst_buf = NULL;
-      free(src_file);
-      src_file = NULL;
-      free(dst_file);
-      src_file = NULL;
-      return ENOMEM;
+  // A source resolving to the new directory itself has nothing to copy, and
+  // locking it a second time for writing would never return
+  inode *dest_dir = NULL;
+  err = resolve_path(fs, dest, &dest_dir);
+  if (err == 0 && dest_dir != src_dir) {
+    err = lock_path(fs, dest, &dest_dir, true);
+    if (err == 0) {
+      copy_op op = {fs, dest_dir, 0};
+      copy_job job = {src_dir, dest_dir, &op};
+      pool_run(copy_top_task, &job);
+      err = op.err;
     }
-
-    copy(src_file, dst_file);
-    free(src_buf);
-    src_buf = NULL;
-    free(dst_buf);
-    dst_buf = NULL;
-    free(src_file);
-    src_file = NULL;
-    free(dst_file);
-    src_file = NULL;
+    unlock_inode(dest_dir);
   }
 
-  free(parent);
-  parent = NULL;
-  return 0;
+  unlock_inode(src_dir);
+  pthread_mutex_unlock(&fs->rename_lock);
+  return err;
 }
 
-int copy(const char *src, const char *dest) {
+int copy(_fs *fs, const char *src, const char *dest) {
+  TRACE_SPAN(__func__, src);
   inode *src_entity = NULL;
-  int err = resolve_path(src, &src_entity);
+  int err = resolve_path(fs, src, &src_entity);
   if (err != 0 || src_entity == NULL) {
     return err != 0 ? err : ENOENT;
   }
 
   if (src_entity->filetype == S_IFDIR) {
-    copy_dir(src, dest);
+    copy_dir(fs, src, dest);
   } else {
-    copy_file(src, dest);
+    copy_file(fs, src, dest);
   }
 
   return 0;
 }
 
-void init_fs(void) {
-  fs.root = (inode *)malloc(sizeof(inode));
-  memset(fs.root, 0, sizeof(inode));
-  fs.working_dir = fs.root;
+void init_fs(_fs *fs) {
+  memset(fs, 0, sizeof(*fs));
+  pthread_rwlock_init(&fs->lock, NULL);
+  pthread_mutex_init(&fs->rename_lock, NULL);
+  pthread_mutex_init(&fs->inodes.lock, NULL);
+  pthread_rwlock_init(&fs->handles.lock, NULL);
+  fs->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+
+  fs->root = alloc_inode(fs);
+  if (fs->root == NULL) {
+    exit(ENOMEM);
+  }
+  fs->working_dir = fs->root;
 
   // Add proper information to root ;
-  fs.root->reference_count = 0;
-  fs.root->filetype = S_IFDIR;
-  fs.root->data_size = 0;
-  fs.root->data = NULL;
-  fs.root->sorted = true;
+  fs->root->reference_count = 0;
+  fs->root->filetype = S_IFDIR;
+  fs->root->data_size = 0;
+  fs->root->data = NULL;
 
-  int err = add_entry("/", ".", fs.root);
+  int err = add_entry(fs, "/", ".", fs->root);
   if (err != 0) {
-    free(fs.root->data);
-    free(fs.root);
+    dir_free(fs->root);
+    clear_inodes(fs);
     exit(err);
   }
-  err = add_entry("/", "..", fs.root);
+  err = add_entry(fs, "/", "..", fs->root);
   if (err != 0) {
-    free(fs.root->data);
-    free(fs.root);
+    dir_free(fs->root);
+    clear_inodes(fs);
     exit(err);
   }
 }
 
-int clear_fs(void) {
-  int err = delete_dir("/");
+int clear_fs(_fs *fs) {
+  // Files only kept by their handles go with everything else
+  close_handles(fs);
+  int err = delete_dir(fs, "/");
   if (err != 0) {
     return err;
   }
-
-  free(fs.root->data);
-  fs.root->data = NULL;
-  fs.root->data_size = 0;
-  free(fs.root);
-  fs.root = NULL;
+  note_removal(fs);
+
+  // Nothing else runs in this instance any more, what it retired only has to
+  // wait for other instances' threads
+  reclaim_fs(fs);
+  dir_free(fs->root);
+  free_inode(fs, fs->root);
+  fs->root = NULL;
+  clear_inodes(fs);
+  dcache_clear();
+  unmap_image(fs);
 
   return 0;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -9,17 +10,80 @@
 
 typedef enum filetype { S_IFDIR, S_IFREG, S_IFLNK } ftype;
 
+struct filesystem;
+struct mapping;
+
 typedef struct inode {
-  uint8_t reference_count;
+  uint32_t reference_count; // Links, and open handles, see handle_table
   ftype filetype;
-  bool sorted;
+  bool allocated;      // False while the slot sits on the free list
+  uint32_t generation; // Bumped when a directory's entries change or on free
+  uint32_t ino;        // Position in the inode table, stable while allocated
   size_t data_size; // Data Size in Bytes
-  void *data;
+  void *data;       // file_data (see file.h), or a directory (see dir.h)
+  pthread_rwlock_t lock; // Held by writers of data, readers take none
+  struct filesystem *fs; // Instance the inode belongs to
+  uint32_t touched;      // pack_clock when the contents were last used
 } inode;
 
+// Inodes live in slabs of INODE_TABLE_SIZE, freed ones are chained through
+// their data pointer until reused
+typedef struct inode_table {
+  pthread_mutex_t lock; // Parallel cp -r and rm -r allocate from many threads
+  inode **slabs;
+  size_t slab_count;
+  size_t next; // First slot that was never handed out
+  inode *free_list;
+  size_t live;
+} inode_table;
+
+// Descriptors are a slot index with the slot's generation above it, the
+// generation is bumped on close so a descriptor kept past its close fails
+// even once its slot is reused
+#define HANDLE_SLOT_BITS 16
+#define HANDLE_MAX (1 << HANDLE_SLOT_BITS)
+#define HANDLE_GENERATION_MASK 0x7fff
+
+typedef struct handle {
+  inode *node; // Pinned while open, NULL while the slot is free
+  uint32_t generation;
+} handle;
+
+// Files opened by descriptor, shared by everyone using the instance. Opening
+// and closing hold lock for writing, using a handle holds it for reading.
+// Slots are handed out lowest first, like POSIX descriptors, so replaying
+// the same commands hands out the same descriptors.
+typedef struct handle_table {
+  pthread_rwlock_t lock;
+  handle *slots;
+  size_t capacity;
+} handle_table;
+
+// One independent tree. Every call takes the instance it works on, instances
+// share nothing but the thread pool and epoch reclamation, so each can run on
+// threads of its own. Slabs, tables and file contents are allocated, and so
+// first touched, by the threads running the instance's commands, which keeps
+// them in those threads' local memory.
+//
+// Every command holds lock for reading, those that replace or dump the whole
+// tree (save, load, checkpoint) hold it for writing. Within a command, inodes
+// are locked one by one along the path, see lock_path, while lookups take no
+// lock at all. rename_lock is only taken by operations that work in two
+// places of the tree at once, moves also bump renames before and after so
+// lookups that raced with one can tell and start over.
 typedef struct filesystem {
+  pthread_rwlock_t lock;
+  pthread_mutex_t rename_lock;
+  uint64_t id;      // Never reused, even by an instance at the same address
+  uint64_t renames; // Odd while a move is in progress
   inode *root;
   inode *working_dir;
+  uint64_t removals; // Number of directory entries removed so far
+  inode_table inodes;
+  handle_table handles;
+  uint64_t unreclaimed; // Inodes retired but not freed yet
+  size_t unreleased;    // Subtrees unlinked but left to the reaper, see fs.c
+  struct mapping *image; // Snapshot loaded, see load_fs
 } _fs;
 
 typedef struct DIR_ENTRY {
@@ -27,39 +91,106 @@ typedef struct DIR_ENTRY {
   inode *item;
 } DIR_ENTRY;
 
+// Part of a path string, neither NUL terminated nor owned. Paths are taken
+// apart into views of the caller's string rather than into copies.
+typedef struct path_view {
+  const char *str;
+  size_t len;
+} path_view;
+
 // Create files
-int create_dir(const char *path);
-int create_file(const char *path);
-int create_hardlink(const char *dest, const char *target);
-int create_symlink(const char *dest, const char *target);
+int create_dir(_fs *fs, const char *path);
+int create_file(_fs *fs, const char *path);
+int create_hardlink(_fs *fs, const char *dest, const char *target);
+int create_symlink(_fs *fs, const char *dest, const char *target);
 
 // Delete file
-int delete_dir(const char *path);
-int delete_file(const char *path);
-int delete_g(const char *path);
+int delete_dir(_fs *fs, const char *path);
+int delete_file(_fs *fs, const char *path);
+int delete_g(_fs *fs, const char *path);
 
-// Write data to file
-int write_file(const char *path, char *data);
-int append_file(const char *path, const char *data);
+// Write data to file. Contents are len bytes of anything, NULs included.
+int write_file(_fs *fs, const char *path, const char *data, size_t len);
+int append_file(_fs *fs, const char *path, const char *data, size_t len);
+// Write at an offset, past the end leaves zeros in between, and cut or
+// extend with zeros to size. Only the extents involved are touched.
+int pwrite_file(_fs *fs, const char *path, size_t offset, const char *data,
+                size_t len);
+int truncate_file(_fs *fs, const char *path, size_t size);
 
 // Add directory entry
-int add_entry(const char *path, const char *name, inode *target);
-int remove_entry(const char *path, const char *name);
+int add_entry(_fs *fs, const char *path, const char *name, inode *target);
+int remove_entry(_fs *fs, const char *path, const char *name);
 int entry_exists(inode *dir, const char *name);
 
-// Path utilities
-int resolve_path(const char *path, inode **result);
-char *parent_of(const char *path);
-char *filename(const char *path);
-char *append(const char *path, const char *path_complement);
+// Locking. lock_path resolves a path hand over hand and returns with *result
+// locked, for writing if asked, even on failure. Unlock it with unlock_inode.
+int lock_path(_fs *fs, const char *path, inode **result, bool write);
+int lock_view(_fs *fs, path_view path, inode **result, bool write);
+void lock_inode(inode *node, bool write);
+void unlock_inode(inode *node);
+// A pinned inode stays allocated after it is unlocked, until it is unpinned
+void pin_inode(inode *node);
+// Pin unless the last reference is already gone and the inode is on its way
+// to being freed
+bool try_pin_inode(inode *node);
+void unpin_inode(inode *node);
+// Sort a directory for listing, if it is not sorted already
+void sort_dir(inode *dir);
+
+// Relative paths start from fs->working_dir, unless this thread was handed a
+// directory of that instance. Server sessions each have one, see server.h.
+void use_working_dir(inode *dir);
+inode *working_dir(_fs *fs);
+
+// Path utilities. resolve_path takes no lock and writes nothing shared, call
+// it inside an epoch section (see epoch.h), *result stays valid until the
+// section ends.
+int resolve_path(_fs *fs, const char *path, inode **result);
+int resolve_view(_fs *fs, path_view path, inode **result);
+path_view path_of(const char *path);
+// Everything before the last slash, "/" for names at the top and "." for
+// paths without any slash
+path_view path_parent(path_view path);
+// Everything after the last slash, filename stays NUL terminated like path
+path_view path_name(path_view path);
+const char *filename(const char *path);
+// Take the next component off the front of *rest, skipping slashes. False
+// once there is none left.
+bool path_next(path_view *rest, path_view *component);
+
+int move_entry(_fs *fs, const char *src, const char *dest);
+
+// Open files. A handle pins the file it was opened on, which stays usable
+// after it is unlinked, until the handle is closed, and skips resolving a
+// path on every access. resolve_handle is to a descriptor what resolve_path
+// is to a path. A closed or never opened descriptor is EBADF.
+int open_file(_fs *fs, const char *path, int *fd);
+int close_file(_fs *fs, int fd);
+int resolve_handle(_fs *fs, int fd, inode **result);
+int write_handle(_fs *fs, int fd, const char *data, size_t len);
+int append_handle(_fs *fs, int fd, const char *data, size_t len);
+int pwrite_handle(_fs *fs, int fd, size_t offset, const char *data,
+                  size_t len);
+int truncate_handle(_fs *fs, int fd, size_t size);
+// Close every handle, see clear_fs
+void close_handles(_fs *fs);
 
 // Copy util... Bordel de merde qu'est ce que ca me soule ca
-int copy_file(const char *src, const char *dest);
-int copy_dir(const char *src, const char *dest);
-int copy(const char *src, const char *dest);
+int copy_file(_fs *fs, const char *src, const char *dest);
+int copy_dir(_fs *fs, const char *src, const char *dest);
+int copy(_fs *fs, const char *src, const char *dest);
 
-// FS Utilities
-void init_fs(void);
-int clear_fs(void);
+// Inode table
+inode *alloc_inode(_fs *fs);
+void free_inode(_fs *fs, inode *node);
+inode *get_inode(_fs *fs, uint32_t ino);
+void clear_inodes(_fs *fs);
 
-extern _fs fs;
+// Instances. init_fs sets up an empty tree in memory the caller provides,
+// clear_fs tears the tree down and leaves the instance ready to be dropped.
+void init_fs(_fs *fs);
+int clear_fs(_fs *fs);
+// Wait until every inode unlinked so far is freed. Only for callers that
+// have the whole instance to themselves, see epoch_synchronize.
+void reclaim_fs(_fs *fs);
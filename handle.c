@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "file.h"
+#include "fs.h"
+#include "trace.h"
+
+static int descriptor(size_t slot, uint32_t generation) {
+  return (int)(((generation & HANDLE_GENERATION_MASK) << HANDLE_SLOT_BITS) |
+               slot);
+}
+
+// Slot fd refers to, if it is open and was not closed since fd was handed out
+static handle *find_handle(handle_table *table, int fd) {
+  if (fd < 0) {
+    return NULL;
+  }
+  size_t slot = (size_t)fd & (HANDLE_MAX - 1);
+  uint32_t generation = (uint32_t)fd >> HANDLE_SLOT_BITS;
+  if (slot >= table->capacity || table->slots[slot].node == NULL ||
+      (table->slots[slot].generation & HANDLE_GENERATION_MASK) != generation) {
+    return NULL;
+  }
+  return &table->slots[slot];
+}
+
+int open_file(_fs *fs, const char *path, int *fd) {
+  TRACE_SPAN(__func__, path);
+  inode *file = NULL;
+  int err = lock_path(fs, path, &file, false);
+  if (err == 0 && file->filetype == S_IFDIR) {
+    err = EISDIR;
+  }
+  // A file unlinked after the lookup found it may be on its way to being
+  // freed
+  if (err == 0 && !try_pin_inode(file)) {
+    err = ENOENT;
+  }
+  unlock_inode(file);
+  if (err != 0) {
+    return err;
+  }
+
+  handle_table *table = &fs->handles;
+  pthread_rwlock_wrlock(&table->lock);
+  size_t slot = 0;
+  while (slot < table->capacity && table->slots[slot].node != NULL) {
+    slot++;
+  }
+  if (slot == table->capacity) {
+    size_t capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+    if (capacity > HANDLE_MAX) {
+      capacity = HANDLE_MAX;
+    }
+    handle *slots = slot < capacity
+                        ? realloc(table->slots, capacity * sizeof(handle))
+                        : NULL;
+    if (slots == NULL) {
+      pthread_rwlock_unlock(&table->lock);
+      unpin_inode(file);
+      return slot < capacity ? ENOMEM : EMFILE;
+    }
+    for (size_t i = table->capacity; i < capacity; i++) {
+      slots[i] = (handle){NULL, 0};
+    }
+    table->slots = slots;
+    table->capacity = capacity;
+  }
+  table->slots[slot].node = file;
+  *fd = descriptor(slot, table->slots[slot].generation);
+  pthread_rwlock_unlock(&table->lock);
+  return 0;
+}
+
+int close_file(_fs *fs, int fd) {
+  TRACE_SPAN(__func__, NULL);
+  handle_table *table = &fs->handles;
+  pthread_rwlock_wrlock(&table->lock);
+  handle *h = find_handle(table, fd);
+  inode *file = h != NULL ? h->node : NULL;
+  if (h != NULL) {
+    h->node = NULL;
+    h->generation++;
+  }
+  pthread_rwlock_unlock(&table->lock);
+
+  if (file == NULL) {
+    return EBADF;
+  }
+  unpin_inode(file);
+  return 0;
+}
+
+// A concurrent close may unpin the file right after, it stays allocated
+// until the caller's epoch section ends like anything resolve_path finds
+int resolve_handle(_fs *fs, int fd, inode **result) {
+  handle_table *table = &fs->handles;
+  pthread_rwlock_rdlock(&table->lock);
+  handle *h = find_handle(table, fd);
+  if (h != NULL) {
+    *result = h->node;
+  }
+  pthread_rwlock_unlock(&table->lock);
+  return h != NULL ? 0 : EBADF;
+}
+
+// The file behind fd, locked for writing. The handle stays open until
+// unlock_handle, however long the write runs.
+static inode *lock_handle(_fs *fs, int fd) {
+  handle_table *table = &fs->handles;
+  pthread_rwlock_rdlock(&table->lock);
+  handle *h = find_handle(table, fd);
+  if (h == NULL) {
+    pthread_rwlock_unlock(&table->lock);
+    return NULL;
+  }
+  lock_inode(h->node, true);
+  return h->node;
+}
+
+static void unlock_handle(_fs *fs, inode *file) {
+  unlock_inode(file);
+  pthread_rwlock_unlock(&fs->handles.lock);
+}
+
+int write_handle(_fs *fs, int fd, const char *data, size_t len) {
+  TRACE_SPAN(__func__, NULL);
+  inode *file = lock_handle(fs, fd);
+  if (file == NULL) {
+    return EBADF;
+  }
+  int err = file_write(file, data, len);
+  unlock_handle(fs, file);
+  return err;
+}
+
+int append_handle(_fs *fs, int fd, const char *data, size_t len) {
+  TRACE_SPAN(__func__, NULL);
+  inode *file = lock_handle(fs, fd);
+  if (file == NULL) {
+    return EBADF;
+  }
+  int err = file_append(file, data, len);
+  unlock_handle(fs, file);
+  return err;
+}
+
+int pwrite_handle(_fs *fs, int fd, size_t offset, const char *data,
+                  size_t len) {
+  TRACE_SPAN(__func__, NULL);
+  inode *file = lock_handle(fs, fd);
+  if (file == NULL) {
+    return EBADF;
+  }
+  int err = file_pwrite(file, data, len, offset);
+  unlock_handle(fs, file);
+  return err;
+}
+
+int truncate_handle(_fs *fs, int fd, size_t size) {
+  TRACE_SPAN(__func__, NULL);
+  inode *file = lock_handle(fs, fd);
+  if (file == NULL) {
+    return EBADF;
+  }
+  int err = file_truncate(file, size);
+  unlock_handle(fs, file);
+  return err;
+}
+
+void close_handles(_fs *fs) {
+  handle_table *table = &fs->handles;
+  pthread_rwlock_wrlock(&table->lock);
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->slots[i].node != NULL) {
+      unpin_inode(table->slots[i].node);
+    }
+  }
+  free(table->slots);
+  table->slots = NULL;
+  table->capacity = 0;
+  pthread_rwlock_unlock(&table->lock);
+}
@@ -0,0 +1,105 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+#include "stats.h"
+
+// Make room for one more slab in the table, slabs themselves never move so
+// inode pointers stay valid for the lifetime of the filesystem
+static int grow_table(inode_table *table) {
+  inode **slabs =
+      realloc(table->slabs, (table->slab_count + 1) * sizeof(inode *));
+  if (slabs == NULL) {
+    return ENOMEM;
+  }
+  table->slabs = slabs;
+
+  inode *slab = malloc(INODE_TABLE_SIZE * sizeof(inode));
+  if (slab == NULL) {
+    return ENOMEM;
+  }
+  table->slabs[table->slab_count++] = slab;
+  return 0;
+}
+
+inode *alloc_inode(_fs *fs) {
+  inode_table *table = &fs->inodes;
+  inode *node = NULL;
+
+  pthread_mutex_lock(&table->lock);
+
+  // Reuse freed slots first, then carve new ones out of the last slab
+  if (table->free_list != NULL) {
+    node = table->free_list;
+    table->free_list = node->data;
+  } else {
+    if (table->next == table->slab_count * INODE_TABLE_SIZE &&
+        grow_table(table) != 0) {
+      pthread_mutex_unlock(&table->lock);
+      return NULL;
+    }
+    node = &table->slabs[table->next / INODE_TABLE_SIZE]
+                        [table->next % INODE_TABLE_SIZE];
+    node->ino = (uint32_t)table->next++;
+    node->generation = 0;
+    node->fs = fs;
+    pthread_rwlock_init(&node->lock, NULL);
+  }
+  table->live++;
+  pthread_mutex_unlock(&table->lock);
+  stat_add(STAT_INODE_ALLOCS, 1);
+
+  // The inode number, generation, lock and owner survive reuse of the slot
+  node->reference_count = 0;
+  node->filetype = S_IFREG;
+  node->allocated = true;
+  node->data_size = 0;
+  node->data = NULL;
+  node->touched = 0;
+  return node;
+}
+
+void free_inode(_fs *fs, inode *node) {
+  inode_table *table = &fs->inodes;
+
+  // Anything remembering this inode by number and generation sees it change
+  __atomic_add_fetch(&node->generation, 1, __ATOMIC_RELEASE);
+  node->allocated = false;
+
+  pthread_mutex_lock(&table->lock);
+  node->data = table->free_list;
+  table->free_list = node;
+  table->live--;
+  pthread_mutex_unlock(&table->lock);
+  stat_add(STAT_INODE_FREES, 1);
+}
+
+inode *get_inode(_fs *fs, uint32_t ino) {
+  if (ino >= fs->inodes.next) {
+    return NULL;
+  }
+
+  inode *node =
+      &fs->inodes.slabs[ino / INODE_TABLE_SIZE][ino % INODE_TABLE_SIZE];
+  return node->allocated ? node : NULL;
+}
+
+void clear_inodes(_fs *fs) {
+  inode_table *table = &fs->inodes;
+  for (size_t i = 0; i < table->next; i++) {
+    pthread_rwlock_destroy(
+        &table->slabs[i / INODE_TABLE_SIZE][i % INODE_TABLE_SIZE].lock);
+  }
+  for (size_t i = 0; i < table->slab_count; i++) {
+    free(table->slabs[i]);
+  }
+  free(table->slabs);
+
+  // The lock stays, the instance may get a new tree
+  table->slabs = NULL;
+  table->slab_count = 0;
+  table->next = 0;
+  table->free_list = NULL;
+  table->live = 0;
+}
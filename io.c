@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "io.h"
+
+typedef struct output {
+  char buffer[OUTPUT_BUFFER_SIZE];
+  size_t len;
+} output;
+
+typedef struct input {
+  char *buffer;
+  size_t capacity;
+  size_t start;   // First byte not handed out yet
+  size_t end;     // End of the bytes read so far
+  size_t scanned; // Bytes after start already known to hold no newline
+  bool opened;
+  bool mapped;
+  bool eof;
+} input;
+
+static output out;
+static input in;
+static _Thread_local out_buffer *capture = NULL;
+
+// writev until everything went out, retrying short writes
+static void write_all(struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(STDOUT_FILENO, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= (ssize_t)iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= (size_t)written;
+    }
+  }
+}
+
+void out_capture(out_buffer *buffer) { capture = buffer; }
+
+// Make room for len more bytes in the captured buffer
+static char *capture_reserve(size_t len) {
+  if (capture->capacity - capture->len < len) {
+    size_t capacity = capture->capacity == 0 ? 4096 : capture->capacity;
+    while (capacity - capture->len < len) {
+      capacity *= 2;
+    }
+    char *data = realloc(capture->data, capacity);
+    if (data == NULL) {
+      exit(ENOMEM);
+    }
+    capture->data = data;
+    capture->capacity = capacity;
+  }
+  return capture->data + capture->len;
+}
+
+void out_write(const char *data, size_t len) {
+  if (capture != NULL) {
+    memcpy(capture_reserve(len), data, len);
+    capture->len += len;
+    return;
+  }
+
+  if (len <= OUTPUT_BUFFER_SIZE - out.len) {
+    memcpy(out.buffer + out.len, data, len);
+    out.len += len;
+    return;
+  }
+
+  // Large writes skip the copy and leave together with the buffer
+  struct iovec iov[2] = {{out.buffer, out.len}, {(void *)data, len}};
+  write_all(iov, 2);
+  out.len = 0;
+}
+
+void out_str(const char *str) { out_write(str, strlen(str)); }
+
+void out_char(char c) {
+  if (capture != NULL) {
+    *capture_reserve(1) = c;
+    capture->len++;
+    return;
+  }
+
+  if (out.len == OUTPUT_BUFFER_SIZE) {
+    out_flush();
+  }
+  out.buffer[out.len++] = c;
+}
+
+// Format into the captured buffer, trying whatever room it has left first
+static void capture_printf(const char *format, va_list args) {
+  va_list again;
+  va_copy(again, args);
+  size_t room = capture->capacity - capture->len;
+  int len = vsnprintf(room > 0 ? capture->data + capture->len : NULL, room,
+                      format, args);
+  if (len >= 0 && (size_t)len >= room) {
+    vsnprintf(capture_reserve((size_t)len + 1), (size_t)len + 1, format,
+              again);
+  }
+  va_end(again);
+  if (len >= 0) {
+    capture->len += (size_t)len;
+  }
+}
+
+void out_printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  if (capture != NULL) {
+    capture_printf(format, args);
+    va_end(args);
+    return;
+  }
+  int len = vsnprintf(out.buffer + out.len, OUTPUT_BUFFER_SIZE - out.len,
+                      format, args);
+  va_end(args);
+
+  if (len < 0) {
+    return;
+  }
+  if ((size_t)len < OUTPUT_BUFFER_SIZE - out.len) {
+    out.len += (size_t)len;
+    return;
+  }
+
+  // Did not fit, format it again on its own
+  char *message = malloc((size_t)len + 1);
+  if (message == NULL) {
+    return;
+  }
+  va_start(args, format);
+  vsnprintf(message, (size_t)len + 1, format, args);
+  va_end(args);
+  out_write(message, (size_t)len);
+  free(message);
+}
+
+void out_flush(void) {
+  struct iovec iov = {out.buffer, out.len};
+  write_all(&iov, 1);
+  out.len = 0;
+}
+
+// Map stdin if it is a file, pipes and terminals cannot seek
+static void map_input(void) {
+  off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+  off_t size = lseek(STDIN_FILENO, 0, SEEK_END);
+  if (offset < 0 || size <= 0) {
+    return;
+  }
+
+  // Private and writable, lines are NUL terminated in place
+  char *map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   STDIN_FILENO, 0);
+  if (map == MAP_FAILED) {
+    lseek(STDIN_FILENO, offset, SEEK_SET);
+    return;
+  }
+
+  in.buffer = map;
+  in.capacity = (size_t)size;
+  in.start = (size_t)offset;
+  in.end = (size_t)size;
+  in.mapped = true;
+  in.eof = true;
+}
+
+// Read another block, making room for it first
+static bool fill_input(void) {
+  if (in.start > 0) {
+    memmove(in.buffer, in.buffer + in.start, in.end - in.start);
+    in.end -= in.start;
+    in.start = 0;
+  }
+
+  // Keep a spare byte for terminating a last line without newline
+  if (in.capacity - in.end < INPUT_BLOCK_SIZE + 1) {
+    size_t capacity =
+        in.capacity == 0 ? INPUT_BLOCK_SIZE + 1 : in.capacity * 2;
+    char *buffer = realloc(in.buffer, capacity);
+    if (buffer == NULL) {
+      exit(ENOMEM);
+    }
+    in.buffer = buffer;
+    in.capacity = capacity;
+  }
+
+  // Whoever feeds us may be waiting for the answers before sending more
+  out_flush();
+
+  ssize_t got = 0;
+  do {
+    got = read(STDIN_FILENO, in.buffer + in.end, in.capacity - in.end - 1);
+  } while (got < 0 && errno == EINTR);
+
+  if (got <= 0) {
+    in.eof = true;
+    return false;
+  }
+  in.end += (size_t)got;
+  return true;
+}
+
+char *in_line(void) {
+  if (!in.opened) {
+    in.opened = true;
+    map_input();
+  }
+
+  for (;;) {
+    char *line = in.buffer + in.start;
+    char *newline = NULL;
+    if (in.end > in.start) {
+      newline =
+          memchr(line + in.scanned, '\n', in.end - in.start - in.scanned);
+    }
+    if (newline != NULL) {
+      *newline = '\0';
+      in.start = (size_t)(newline - in.buffer) + 1;
+      in.scanned = 0;
+      return line;
+    }
+    in.scanned = in.end - in.start;
+
+    if (!in.eof && fill_input()) {
+      continue;
+    }
+
+    // Last line without a newline
+    line = in.buffer + in.start;
+    if (in.start == in.end) {
+      return NULL;
+    }
+    if (in.mapped) {
+      // No room to terminate it inside the mapping
+      char *copy = malloc(in.end - in.start + 1);
+      if (copy == NULL) {
+        exit(ENOMEM);
+      }
+      memcpy(copy, line, in.end - in.start);
+      munmap(in.buffer, in.capacity);
+      in.buffer = copy;
+      in.capacity = in.end - in.start + 1;
+      in.end -= in.start;
+      in.start = 0;
+      in.mapped = false;
+      line = in.buffer;
+    }
+    line[in.end - in.start] = '\0';
+    in.start = in.end;
+    in.scanned = 0;
+    return line;
+  }
+}
+
+void in_close(void) {
+  if (in.mapped) {
+    munmap(in.buffer, in.capacity);
+  } else {
+    free(in.buffer);
+  }
+  memset(&in, 0, sizeof(in));
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define INPUT_BLOCK_SIZE (256 * 1024)
+
+// Everything printed to stdout goes through one buffer. Writes too large for
+// what is left of it are not copied, they go out together with the buffer in
+// a single writev.
+void out_write(const char *data, size_t len);
+void out_str(const char *str);
+void out_char(char c);
+void out_printf(const char *format, ...);
+void out_flush(void);
+
+// Output of a server session, collected until the client can take it
+typedef struct out_buffer {
+  char *data;
+  size_t len;
+  size_t capacity;
+} out_buffer;
+
+// While a buffer is captured, everything this thread prints is appended to it
+// instead of going to stdout. NULL goes back to stdout.
+void out_capture(out_buffer *buffer);
+
+// Commands are read from stdin in large blocks, or mapped when stdin is a
+// file. in_line returns the next line without its newline, NUL terminated
+// and writable, or NULL at the end of input. Lines can be of any length.
+char *in_line(void);
+void in_close(void);
@@ -0,0 +1,209 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+typedef struct journal_state {
+  FILE *file;
+  uint64_t sequence; // Last sequence number handed out
+  unsigned window_ms;
+  bool dirty; // Records were written since the last fsync
+  bool stop;
+  pthread_t flusher;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} journal_state;
+
+static journal_state journal = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                .wake = PTHREAD_COND_INITIALIZER};
+
+// Group commit: once something is dirty, wait one window so the records of
+// every command arriving meanwhile go out with a single fsync
+static void *flush_loop(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&journal.lock);
+  while (!journal.stop) {
+    if (!journal.dirty) {
+      pthread_cond_wait(&journal.wake, &journal.lock);
+      continue;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += journal.window_ms / 1000;
+    deadline.tv_nsec += (long)(journal.window_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (!journal.stop &&
+           pthread_cond_timedwait(&journal.wake, &journal.lock, &deadline) !=
+               ETIMEDOUT) {
+    }
+
+    // Appenders only need the lock to write, not to wait for the disk
+    journal.dirty = false;
+    int fd = fileno(journal.file);
+    pthread_mutex_unlock(&journal.lock);
+    fsync(fd);
+    pthread_mutex_lock(&journal.lock);
+  }
+  pthread_mutex_unlock(&journal.lock);
+
+  return NULL;
+}
+
+int journal_open(const char *path, uint64_t sequence, unsigned window_ms) {
+  journal.file = fopen(path, "ab");
+  if (journal.file == NULL) {
+    return errno;
+  }
+  journal.sequence = sequence;
+  journal.window_ms = window_ms;
+  journal.dirty = false;
+  journal.stop = false;
+
+  if (window_ms > 0 &&
+      pthread_create(&journal.flusher, NULL, flush_loop, NULL) != 0) {
+    fclose(journal.file);
+    journal.file = NULL;
+    return EAGAIN;
+  }
+
+  return 0;
+}
+
+int journal_append(const char *line) {
+  size_t len = strlen(line);
+  const char *end = len > 0 && line[len - 1] == '\n' ? "" : "\n";
+
+  pthread_mutex_lock(&journal.lock);
+
+  // Each record reaches the kernel right away, only the fsync is grouped
+  int err = 0;
+  if (fprintf(journal.file, "%" PRIu64 " %s%s", ++journal.sequence, line,
+              end) < 0 ||
+      fflush(journal.file) != 0) {
+    err = EIO;
+  } else if (journal.window_ms == 0) {
+    err = fsync(fileno(journal.file)) == 0 ? 0 : errno;
+  } else if (!journal.dirty) {
+    journal.dirty = true;
+    pthread_cond_signal(&journal.wake);
+  }
+
+  pthread_mutex_unlock(&journal.lock);
+  return err;
+}
+
+bool journal_records(const char *line) {
+  static const char *commands[] = {"touch", "mkdir", "echo",  "mv",
+                                   "cp",    "rm",    "ln",    "cd",
+                                   "load",  "open",  "write", "append",
+                                   "close", "pwrite", "truncate",
+                                   "ftruncate"};
+
+  line += strspn(line, " \n");
+  size_t len = strcspn(line, " \n");
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strlen(commands[i]) == len && strncmp(line, commands[i], len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int journal_sync(void) {
+  pthread_mutex_lock(&journal.lock);
+  int err = 0;
+  if (fflush(journal.file) != 0 || fsync(fileno(journal.file)) != 0) {
+    err = errno;
+  }
+  journal.dirty = false;
+  pthread_mutex_unlock(&journal.lock);
+  return err;
+}
+
+// Drop every record, they are all covered by a snapshot now. Sequence
+// numbers keep counting from where they were.
+int journal_truncate(void) {
+  pthread_mutex_lock(&journal.lock);
+  int err = 0;
+  if (fflush(journal.file) != 0 || ftruncate(fileno(journal.file), 0) != 0 ||
+      fsync(fileno(journal.file)) != 0) {
+    err = errno;
+  }
+  journal.dirty = false;
+  pthread_mutex_unlock(&journal.lock);
+  return err;
+}
+
+void journal_close(void) {
+  if (journal.file == NULL) {
+    return;
+  }
+
+  if (journal.window_ms > 0) {
+    pthread_mutex_lock(&journal.lock);
+    journal.stop = true;
+    pthread_cond_signal(&journal.wake);
+    pthread_mutex_unlock(&journal.lock);
+    pthread_join(journal.flusher, NULL);
+  }
+
+  journal_sync();
+  fclose(journal.file);
+  journal.file = NULL;
+}
+
+bool journal_enabled(void) { return journal.file != NULL; }
+
+uint64_t journal_sequence(void) { return journal.sequence; }
+
+// Apply every complete record numbered after `after`. A record cut short by a
+// crash ends the log, it is cut off so new records do not get glued to it.
+int journal_replay(const char *path, uint64_t after, uint64_t *last,
+                   int (*apply)(char *line)) {
+  *last = after;
+
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    return errno == ENOENT ? 0 : errno;
+  }
+
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t len = 0;
+  long valid_end = 0;
+  bool torn = false;
+
+  while ((len = getline(&line, &capacity, in)) != -1) {
+    char *command = NULL;
+    uint64_t sequence = strtoull(line, &command, 10);
+    if (line[len - 1] != '\n' || command == line || *command != ' ') {
+      torn = true;
+      break;
+    }
+
+    if (sequence > after) {
+      apply(command + 1);
+      *last = sequence;
+    }
+    valid_end = ftell(in);
+  }
+
+  free(line);
+  fclose(in);
+
+  if (torn && truncate(path, valid_end) != 0) {
+    return errno;
+  }
+  return 0;
+}
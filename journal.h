@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Write ahead log of mutating commands. Every record is one line made of a
+// sequence number, a space and the command line as it was typed. A snapshot
+// remembers the last sequence number it contains, so recovery loads the
+// snapshot and replays only the records after it.
+//
+// Records are handed to the kernel right away but fsynced in groups: a
+// flusher thread syncs at most once per commit window, so a crash loses at
+// most the last window of commands. A window of 0 syncs every record.
+
+int journal_open(const char *path, uint64_t sequence, unsigned window_ms);
+int journal_append(const char *line);
+int journal_sync(void);
+int journal_truncate(void);
+void journal_close(void);
+
+// Whether a command line changes the tree, how later paths resolve, or
+// which descriptors are open, and so needs a record
+bool journal_records(const char *line);
+
+bool journal_enabled(void);
+uint64_t journal_sequence(void);
+
+int journal_replay(const char *path, uint64_t after, uint64_t *last,
+                   int (*apply)(char *line));
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_NIBBLE 15 // Lengths that do not fit in their nibble go on in bytes
+
+// A sequence starts with a token, the number of literals in its high nibble
+// and the match length less LZ_MIN_MATCH in the low one. Then come more of
+// the literal count, the literals, the match offset in two bytes, little
+// endian, and more of the match length. The last sequence has literals only.
+
+static uint32_t read32(const char *p) {
+  uint32_t v = 0;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static size_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// What does not fit in the nibble, in bytes of 255 and a last one below.
+// NULL if out of room.
+static char *put_length(char *out, const char *end, size_t len) {
+  for (; len >= 255; len -= 255) {
+    if (out == end) {
+      return NULL;
+    }
+    *out++ = (char)255;
+  }
+  if (out == end) {
+    return NULL;
+  }
+  *out++ = (char)len;
+  return out;
+}
+
+// match is 0 for the last sequence
+static char *put_sequence(char *out, const char *end, const char *literals,
+                          size_t count, size_t offset, size_t match) {
+  if (out == end) {
+    return NULL;
+  }
+  size_t extra = match > 0 ? match - LZ_MIN_MATCH : 0;
+  char *token = out++;
+  *token = (char)((count < LZ_NIBBLE ? count : LZ_NIBBLE) << 4 |
+                  (extra < LZ_NIBBLE ? extra : LZ_NIBBLE));
+  if (count >= LZ_NIBBLE &&
+      (out = put_length(out, end, count - LZ_NIBBLE)) == NULL) {
+    return NULL;
+  }
+  if ((size_t)(end - out) < count) {
+    return NULL;
+  }
+  memcpy(out, literals, count);
+  out += count;
+  if (match == 0) {
+    return out;
+  }
+
+  if (end - out < 2) {
+    return NULL;
+  }
+  *out++ = (char)(offset & 0xff);
+  *out++ = (char)(offset >> 8);
+  if (extra >= LZ_NIBBLE) {
+    out = put_length(out, end, extra - LZ_NIBBLE);
+  }
+  return out;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t capacity) {
+  // Position of the last 4 bytes seen with each hash. Stale or colliding
+  // entries are weeded out by comparing the bytes.
+  uint32_t table[1 << LZ_HASH_BITS] = {0};
+  const char *in = src;
+  const char *anchor = src; // First byte not yet written out
+  const char *end = src + len;
+  char *out = dst;
+  const char *out_end = dst + capacity;
+  // Misses since the last match: data that does not compress is stepped
+  // through faster and faster
+  size_t misses = 0;
+
+  while (len >= LZ_MIN_MATCH && in <= end - LZ_MIN_MATCH) {
+    uint32_t v = read32(in);
+    size_t h = hash4(v);
+    const char *candidate = src + table[h];
+    table[h] = (uint32_t)(in - src);
+    if (candidate >= in || in - candidate > LZ_MAX_OFFSET ||
+        read32(candidate) != v) {
+      in += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+
+    size_t match = LZ_MIN_MATCH;
+    while (in + match < end && candidate[match] == in[match]) {
+      match++;
+    }
+    out = put_sequence(out, out_end, anchor, (size_t)(in - anchor),
+                       (size_t)(in - candidate), match);
+    if (out == NULL) {
+      return 0;
+    }
+    in += match;
+    anchor = in;
+  }
+
+  out = put_sequence(out, out_end, anchor, (size_t)(end - anchor), 0, 0);
+  return out == NULL ? 0 : (size_t)(out - dst);
+}
+
+// The rest of a length after its nibble, false if the input ends first
+static bool get_length(const uint8_t **in, const uint8_t *end, size_t *len) {
+  uint8_t b = 0;
+  do {
+    if (*in == end) {
+      return false;
+    }
+    b = *(*in)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+int lz_decompress(const char *src, size_t len, char *dst, size_t size) {
+  const uint8_t *in = (const uint8_t *)src;
+  const uint8_t *end = in + len;
+  char *out = dst;
+
+  while (in < end) {
+    uint8_t token = *in++;
+    size_t count = token >> 4;
+    if (count == LZ_NIBBLE && !get_length(&in, end, &count)) {
+      return EINVAL;
+    }
+    if (count > (size_t)(end - in) || count > size - (size_t)(out - dst)) {
+      return EINVAL;
+    }
+    memcpy(out, in, count);
+    in += count;
+    out += count;
+    if (in == end) {
+      break;
+    }
+
+    if (end - in < 2) {
+      return EINVAL;
+    }
+    size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+    in += 2;
+    size_t match = token & LZ_NIBBLE;
+    if (match == LZ_NIBBLE && !get_length(&in, end, &match)) {
+      return EINVAL;
+    }
+    match += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(out - dst) ||
+        match > size - (size_t)(out - dst)) {
+      return EINVAL;
+    }
+    // A match closer than its length overlaps the bytes it produces, which
+    // repeats them, and has to go byte by byte
+    if (offset >= match) {
+      memcpy(out, out - offset, match);
+    } else {
+      for (size_t i = 0; i < match; i++) {
+        out[i] = out[(ptrdiff_t)i - (ptrdiff_t)offset];
+      }
+    }
+    out += match;
+  }
+
+  return (size_t)(out - dst) == size ? 0 : EINVAL;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+// Byte oriented LZ77 in the style of LZ4: runs of literals, each followed by
+// a copy of earlier output 4 to any number of bytes long and at most 64 KiB
+// back. Compression is a single greedy pass with a small hash table,
+// decompression is a loop of memcpy, both fast enough to be done on demand.
+
+// Compress src into dst, returning the compressed size, or 0 if it does not
+// fit in capacity bytes
+size_t lz_compress(const char *src, size_t len, char *dst, size_t capacity);
+
+// Decompress src into exactly size bytes at dst, EINVAL if it is not the
+// compressed form of that many bytes
+int lz_decompress(const char *src, size_t len, char *dst, size_t size);
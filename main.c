@@ -1,32 +1,99 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "dedup.h"
+#include "epoch.h"
 #include "fs.h"
+#include "io.h"
+#include "journal.h"
+#include "pack.h"
+#include "pool.h"
+#include "server.h"
+#include "snapshot.h"
+#include "spill.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
-int exec_command(char *line) {
+// The one tree the shell, or the server, works on
+static _fs tree;
+
+// Snapshot given on the command line, checkpoints are written there
+static const char *snapshot_path = NULL;
+
+// Set while a failing command must not end the process: when serving
+// clients (see server.h), and when replaying what they sent
+static bool keep_going = false;
+
+// The shell gives up on the first command that fails. A server has other
+// clients to care about, it tells the one that sent the command instead.
+static int fail(const char *command, int err) {
+  if (!keep_going) {
+    exit(err);
+  }
+  out_printf("%s: %s\n", command, strerror(err));
+  return 0;
+}
+
+// Descriptors are typed back the way open printed them, anything else is
+// no descriptor at all
+static int parse_fd(const char *tok) {
+  char *end = NULL;
+  long fd = tok == NULL ? -1 : strtol(tok, &end, 10);
+  return tok == NULL || *end != '\0' || fd < 0 || fd > INT_MAX ? -1 : (int)fd;
+}
+
+// Offsets and sizes, false for anything but a plain decimal number
+static bool parse_size(const char *tok, size_t *value) {
+  if (tok == NULL || *tok < '0' || *tok > '9') {
+    return false;
+  }
+  char *end = NULL;
+  errno = 0;
+  unsigned long long n = strtoull(tok, &end, 10);
+  *value = (size_t)n;
+  return *end == '\0' && errno == 0 && n <= SIZE_MAX;
+}
+
+// What write and append take: the text between the first and the last
+// double quote, like echo
+static char *quoted(char *rest, size_t *len) {
+  char *start = strchr(rest, '"');
+  char *end = strrchr(rest, '"');
+  if (start == NULL || end == start) {
+    return NULL;
+  }
+  *len = (size_t)(end - start - 1);
+  return start + 1;
+}
+
+static int run_command(_fs *fs, char *line) {
   char *save_ptr = NULL;
   char *tok = strtok_r(line, " \n", &save_ptr);
   if (tok == NULL) {
     return 0;
   }
-  inode *buffer = fs.working_dir;
+  inode *buffer = working_dir(fs);
 
   if (strcmp(tok, "exit") == 0) { // EXIT
     return 1;
   } else if (strcmp(tok, "cd") == 0) { // CD
     tok = strtok_r(NULL, " \n", &save_ptr);
     if (tok == NULL) {
-      fs.working_dir = fs.root;
+      fs->working_dir = fs->root;
       return 0;
     }
-    resolve_path(tok, &fs.working_dir);
+    resolve_path(fs, tok, &fs->working_dir);
   } else if (strcmp(tok, "ls") == 0) { // LS
     tok = strtok_r(NULL, " \n", &save_ptr);
     if (tok != NULL) {
-      resolve_path(tok, &buffer);
+      resolve_path(fs, tok, &buffer);
     }
 
     // List all subdirs of buffer
@@ -38,79 +105,103 @@ int exec_command(char *line) {
       return 0;
     }
     // Resolve path
-    int err = resolve_path(tok, &buffer);
+    int err = resolve_path(fs, tok, &buffer);
 
     // On resolve path error exit because something is very wrong
     if (err == ENOENT) {
-      printf("cat: %s: No such file or directory\n", tok);
+      out_printf("cat: %s: No such file or directory\n", tok);
       return 0;
     }
 
     if (err != 0) {
-      exit(err);
+      return fail("cat", err);
     }
 
-    read_file(buffer);
+    // cat path offset [length] prints only that range
+    size_t offset = 0;
+    size_t len = SIZE_MAX;
+    if (parse_size(strtok_r(NULL, " \n", &save_ptr), &offset)) {
+      parse_size(strtok_r(NULL, " \n", &save_ptr), &len);
+    }
+    read_range(buffer, offset, len);
   } else if (strcmp(tok, "find") == 0) { // FIND
     recursive_list(buffer, ".");
   } else if (strcmp(tok, "touch") == 0) { // TOUCH
     tok = strtok_r(NULL, " \n", &save_ptr);
     while (tok != NULL) {
-      int err = create_file(tok);
+      int err = create_file(fs, tok);
       if (err != 0) {
-        exit(err);
+        return fail("touch", err);
       }
       tok = strtok_r(NULL, " \n", &save_ptr);
     }
   } else if (strcmp(tok, "echo") == 0) { // ECHO
-    parse_echo(line + 6);
+    if (*save_ptr == '\0') {
+      return 0;
+    }
+    parse_echo(fs, line + 6);
   } else if (strcmp(tok, "mkdir") == 0) { // MKDIR
     tok = strtok_r(NULL, " \n", &save_ptr);
-    if (strcmp(tok, "-p") == 0) { // discard -p, since behavior doesnt differ
+    if (tok != NULL && strcmp(tok, "-p") == 0) { // discard -p, since behavior doesnt differ
       tok = strtok_r(NULL, " \n", &save_ptr);
     }
 
     while (tok != NULL) {
-      create_dir(tok);
+      create_dir(fs, tok);
       tok = strtok_r(NULL, " \n", &save_ptr);
     }
   } else if (strcmp(tok, "mv") == 0) { // MV
     char *src = strtok_r(NULL, " \n", &save_ptr);
     char *dest = strtok_r(NULL, " \n", &save_ptr);
+    if (src == NULL || dest == NULL) {
+      return 0;
+    }
 
-    move(src, dest);
+    int err = move(fs, src, dest);
+    if (err != 0) {
+      if (!keep_going) {
+        pack_stop();
+        clear_fs(fs);
+        exit(-1);
+      }
+      return fail("mv", err);
+    }
   } else if (strcmp(tok, "cp") == 0) { // CP
     char *src = strtok_r(NULL, " \n", &save_ptr);
-    if (strcmp(src, "-r") == 0) {
+    if (src != NULL && strcmp(src, "-r") == 0) {
       src = strtok_r(NULL, " \n", &save_ptr);
     }
     char *dest = strtok_r(NULL, " \n", &save_ptr);
+    if (src == NULL || dest == NULL) {
+      return 0;
+    }
 
-    int err = copy(src, dest);
+    int err = copy(fs, src, dest);
     if (err != 0) {
-      exit(err);
+      return fail("cp", err);
     }
   } else if (strcmp(tok, "rm") == 0) { // RM
     tok = strtok_r(NULL, " \n", &save_ptr);
-    if (strcmp(tok, "-r") == 0) {
+    if (tok != NULL && strcmp(tok, "-r") == 0) {
       tok = strtok_r(NULL, " \n", &save_ptr);
     }
 
     while (tok != NULL) {
-      delete_g(tok);
+      delete_g(fs, tok);
 
       tok = strtok_r(NULL, " \n", &save_ptr);
     }
   } else if (strcmp(tok, "ln") == 0) { // LN
     char *src = strtok_r(NULL, " \n", &save_ptr);
-    if (src == NULL) {
-      exit(1);
-    }
-    char *dest = strtok_r(NULL, " \n", &save_ptr);
+    char *dest = src == NULL ? NULL : strtok_r(NULL, " \n", &save_ptr);
     if (dest == NULL) {
-      exit(1);
+      if (!keep_going) {
+        exit(1);
+      }
+      out_printf("ln: missing operand\n");
+      return 0;
     }
-    create_hardlink(dest, src);
+    create_hardlink(fs, dest, src);
     /* Symbolic links disabled
     if (strcmp(tok, "-s") == 0) { // Symbolic
       src = strtok_r(NULL, " \n", &save_ptr);
@@ -118,31 +209,360 @@ int exec_command(char *line) {
       create_symlink(src, dest);
     } else { // HARD
       char *dest = strtok_r(NULL, " \n", &save_ptr);
-      create_hardlink(src, dest);
+      create_hardlink(fs, src, dest);
     } */
+  } else if (strcmp(tok, "open") == 0) { // OPEN
+    tok = strtok_r(NULL, " \n", &save_ptr);
+    if (tok == NULL) {
+      return 0;
+    }
+
+    int fd = -1;
+    int err = open_file(fs, tok, &fd);
+    if (err != 0) {
+      return fail("open", err);
+    }
+    out_printf("%d\n", fd);
+  } else if (strcmp(tok, "read") == 0) { // READ
+    int err = resolve_handle(fs, parse_fd(strtok_r(NULL, " \n", &save_ptr)),
+                             &buffer);
+    if (err != 0) {
+      return fail("read", err);
+    }
+    read_file(buffer);
+  } else if (strcmp(tok, "write") == 0 || strcmp(tok, "append") == 0) {
+    // WRITE, APPEND
+    bool append = tok[0] == 'a';
+    int fd = parse_fd(strtok_r(NULL, " \n", &save_ptr));
+    size_t len = 0;
+    char *data = quoted(save_ptr, &len);
+    int err = EINVAL;
+    if (data != NULL) {
+      err = append ? append_handle(fs, fd, data, len)
+                   : write_handle(fs, fd, data, len);
+    }
+    if (err != 0) {
+      return fail(append ? "append" : "write", err);
+    }
+  } else if (strcmp(tok, "pread") == 0) { // PREAD
+    int fd = parse_fd(strtok_r(NULL, " \n", &save_ptr));
+    size_t offset = 0;
+    size_t len = 0;
+    int err = resolve_handle(fs, fd, &buffer);
+    if (err == 0 && (!parse_size(strtok_r(NULL, " \n", &save_ptr), &offset) ||
+                     !parse_size(strtok_r(NULL, " \n", &save_ptr), &len))) {
+      err = EINVAL;
+    }
+    if (err != 0) {
+      return fail("pread", err);
+    }
+    read_range(buffer, offset, len);
+  } else if (strcmp(tok, "pwrite") == 0) { // PWRITE
+    int fd = parse_fd(strtok_r(NULL, " \n", &save_ptr));
+    size_t offset = 0;
+    size_t len = 0;
+    char *data = NULL;
+    if (parse_size(strtok_r(NULL, " \n", &save_ptr), &offset)) {
+      data = quoted(save_ptr, &len);
+    }
+    int err = data != NULL ? pwrite_handle(fs, fd, offset, data, len) : EINVAL;
+    if (err != 0) {
+      return fail("pwrite", err);
+    }
+  } else if (strcmp(tok, "truncate") == 0 ||
+             strcmp(tok, "ftruncate") == 0) { // TRUNCATE, FTRUNCATE
+    bool by_fd = tok[0] == 'f';
+    tok = strtok_r(NULL, " \n", &save_ptr);
+    size_t size = 0;
+    if (tok == NULL) {
+      return 0;
+    }
+    int err = EINVAL;
+    if (parse_size(strtok_r(NULL, " \n", &save_ptr), &size)) {
+      err = by_fd ? truncate_handle(fs, parse_fd(tok), size)
+                  : truncate_file(fs, tok, size);
+    }
+    if (err != 0) {
+      return fail(by_fd ? "ftruncate" : "truncate", err);
+    }
+  } else if (strcmp(tok, "close") == 0) { // CLOSE
+    int err = close_file(fs, parse_fd(strtok_r(NULL, " \n", &save_ptr)));
+    if (err != 0) {
+      return fail("close", err);
+    }
+  } else if (strcmp(tok, "stats") == 0) { // STATS
+    stats_print();
+  } else if (strcmp(tok, "save") == 0) { // SAVE
+    tok = strtok_r(NULL, " \n", &save_ptr);
+    if (tok == NULL) {
+      return 0;
+    }
+
+    int err = save_fs(fs, tok, journal_sequence());
+    if (err != 0) {
+      out_printf("save: %s: %s\n", tok, strerror(err));
+    }
+  } else if (strcmp(tok, "load") == 0) { // LOAD
+    tok = strtok_r(NULL, " \n", &save_ptr);
+    if (tok == NULL) {
+      return 0;
+    }
+
+    // On failure the current tree is left as it was
+    int err = load_fs(fs, tok, NULL);
+    if (err != 0) {
+      out_printf("load: %s: %s\n", tok, strerror(err));
+    }
+  } else if (strcmp(tok, "checkpoint") == 0) { // CHECKPOINT
+    if (!journal_enabled() || snapshot_path == NULL) {
+      out_printf("checkpoint: no journal and snapshot given\n");
+      return 0;
+    }
+
+    // The journal is only dropped once the snapshot covering it is on disk
+    int err = journal_sync();
+    if (err == 0) {
+      err = save_fs(fs, snapshot_path, journal_sequence());
+    }
+    if (err == 0) {
+      err = journal_truncate();
+    }
+    if (err != 0) {
+      out_printf("checkpoint: %s\n", strerror(err));
+    }
   }
 
   return 0;
 }
 
-int main(void) {
+// Commands lock the inodes they touch, snapshots swap or walk the whole tree
+// and want it to themselves
+static bool exclusive(const char *line) {
+  line += strspn(line, " \n");
+  size_t len = strcspn(line, " \n");
+  return (len == 4 && (strncmp(line, "save", 4) == 0 ||
+                       strncmp(line, "load", 4) == 0)) ||
+         (len == 10 && strncmp(line, "checkpoint", 10) == 0);
+}
+
+// Each command is one epoch section, nothing it looks up is freed before it
+// is done
+static int locked_command(_fs *fs, char *line) {
+  if (exclusive(line)) {
+    pthread_rwlock_wrlock(&fs->lock);
+  } else {
+    pthread_rwlock_rdlock(&fs->lock);
+  }
+  epoch_enter();
+  int end = run_command(fs, line);
+  epoch_exit();
+  pthread_rwlock_unlock(&fs->lock);
+  return end;
+}
+
+static int logged_command(char *line) {
+  if (!journal_enabled() || !journal_records(line)) {
+    return locked_command(&tree, line);
+  }
+
+  // run_command takes the line apart, so keep it as typed. It is logged once
+  // it ran: the tree only lives in memory, so nothing is lost by that, and a
+  // command that aborts the process never reaches the journal and cannot
+  // abort recovery as well.
+  static char *record = NULL;
+  static size_t record_size = 0;
+  size_t len = strlen(line) + 1;
+  if (len > record_size) {
+    char *grown = realloc(record, len);
+    if (grown == NULL) {
+      exit(ENOMEM);
+    }
+    record = grown;
+    record_size = len;
+  }
+  memcpy(record, line, len);
+
+  int end = locked_command(&tree, line);
+  int err = journal_append(record);
+  if (err != 0) {
+    fprintf(stderr, "journal: %s\n", strerror(err));
+    exit(err);
+  }
+  return end;
+}
+
+int exec_command(char *line) {
+  if (!stats_enabled && !trace_enabled) {
+    return logged_command(line);
+  }
+
+  // Timed the way whoever sent it sees it, waiting for locks and the journal
+  // included
+  int command = stats_command(line);
+  TRACE_SPAN(stats_command_name(command), line);
+  uint64_t start = stats_now();
+  int end = logged_command(line);
+  if (stats_enabled) {
+    stats_time(command, stats_now() - start);
+  }
+  return end;
+}
+
+static void write_trace(void) {
+  int err = trace_stop();
+  if (err != 0) {
+    fprintf(stderr, "trace: %s\n", strerror(err));
+  }
+}
+
+int main(int argc, char **argv) {
+  _fs *fs = &tree;
   int end = 0;
 
-  char *line = malloc(200000);
-  size_t line_size = 200000;
+  const char *journal_path = NULL;
+  const char *socket_path = NULL;
+  unsigned window_ms = 10;
+  unsigned threads = 0;
+  int opt = 0;
+  const char *trace_path = NULL;
+  unsigned pack_idle = 0;
+  size_t budget = 0;
+  while ((opt = getopt(argc, argv, "j:w:t:s:ST:Dz:m:")) != -1) {
+    if (opt == 'j') {
+      journal_path = optarg;
+    } else if (opt == 'w') {
+      window_ms = (unsigned)strtoul(optarg, NULL, 10);
+    } else if (opt == 't') {
+      threads = (unsigned)strtoul(optarg, NULL, 10);
+    } else if (opt == 's') {
+      socket_path = optarg;
+    } else if (opt == 'S') {
+      stats_enable();
+    } else if (opt == 'T') {
+      trace_path = optarg;
+    } else if (opt == 'D') {
+      dedup_enable();
+    } else if (opt == 'z') {
+      pack_idle = (unsigned)strtoul(optarg, NULL, 10);
+    } else if (opt == 'm') {
+      budget = (size_t)strtoull(optarg, NULL, 10);
+    } else {
+      fprintf(stderr,
+              "usage: %s [-j journal] [-w commit_window_ms] [-t threads] "
+              "[-s socket] [-S] [-T trace.json] [-D] [-z idle_seconds] "
+              "[-m memory_budget] [snapshot]\n",
+              argv[0]);
+      return EINVAL;
+    }
+  }
+
+  // find, cp -r and rm -r split subtrees among these, -t 1 keeps them serial
+  if (pool_init(threads) != 0) {
+    fprintf(stderr, "%s: could not start threads, running serially\n",
+            argv[0]);
+  }
+  if (optind < argc) {
+    snapshot_path = argv[optind];
+  }
+
+  // Written however the process ends, exit() on an error included
+  if (trace_path != NULL) {
+    int err = trace_start(trace_path);
+    if (err != 0) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], trace_path, strerror(err));
+      return err;
+    }
+    atexit(write_trace);
+  }
+
+  // Contents over the budget are spilled to disk, /var/tmp rather than /tmp,
+  // which is often kept in memory itself
+  if (budget > 0) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL) {
+      dir = "/var/tmp";
+    }
+    int err = spill_start(budget, dir);
+    if (err != 0) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], dir, strerror(err));
+      return err;
+    }
+  }
+
+  init_fs(fs);
+
+  // exit() is used for errors all over the place, output must survive it
+  atexit(out_flush);
+
+  // Start from a snapshot instead of an empty tree if one is given. With a
+  // journal, a missing snapshot only means nothing was checkpointed yet.
+  uint64_t sequence = 0;
+  if (snapshot_path != NULL) {
+    int err = load_fs(fs, snapshot_path, &sequence);
+    if (err != 0 && !(err == ENOENT && journal_path != NULL)) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], snapshot_path, strerror(err));
+      clear_fs(fs);
+      return err;
+    }
+  }
+
+  // Replay what happened after the snapshot, then keep logging
+  if (journal_path != NULL) {
+    // Clients are told about failing commands instead of losing the server,
+    // so the journal may hold some. They fail the same way again, quietly.
+    out_buffer discarded = {0};
+    keep_going = true;
+    out_capture(&discarded);
+    int err = journal_replay(journal_path, sequence, &sequence, exec_command);
+    out_capture(NULL);
+    free(discarded.data);
+    keep_going = false;
+    if (err == 0) {
+      err = journal_open(journal_path, sequence, window_ms);
+    }
+    if (err != 0) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], journal_path, strerror(err));
+      clear_fs(fs);
+      return err;
+    }
+  }
+
+  // Only once the tree is complete, replaying leaves nothing idle. What it
+  // took over the budget is spilled on the first pass.
+  if ((pack_idle > 0 || budget > 0) && pack_start(fs, pack_idle) != 0) {
+    fprintf(stderr, "%s: could not start packing, files stay in memory\n",
+            argv[0]);
+  }
 
-  init_fs();
+  // Clients take the place of stdin
+  if (socket_path != NULL) {
+    keep_going = true;
+    int err = serve(fs, socket_path, exec_command);
+    if (err != 0) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], socket_path, strerror(err));
+    }
+    journal_close();
+    pack_stop();
+    clear_fs(fs);
+    pool_shutdown();
+    return err;
+  }
 
   while (!end) {
-    if (fgets(line, line_size, stdin) == NULL) {
-      free(line);
+    char *line = in_line();
+    if (line == NULL) {
+      in_close();
+      journal_close();
       return -1;
     }
 
     end = exec_command(line);
   }
 
-  free(line);
-  clear_fs();
+  in_close();
+  journal_close();
+  pack_stop();
+  clear_fs(fs);
+  pool_shutdown();
   return 0;
 }
@@ -0,0 +1,366 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dir.h"
+#include "epoch.h"
+#include "file.h"
+#include "fs.h"
+#include "lz.h"
+#include "pack.h"
+#include "spill.h"
+#include "stats.h"
+
+uint32_t pack_clock = 0;
+
+// Keyed by the packed extent, which cannot be freed and its address reused
+// while an entry has it: pack_forget takes it out first
+typedef struct unpacked {
+  extent *packed;
+  extent *plain; // Holds a reference of the cache's own
+  uint64_t used; // Last use, the smallest is evicted
+} unpacked;
+
+static struct {
+  pthread_mutex_t lock;
+  unpacked entries[PACK_CACHE_SIZE];
+  uint64_t uses;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // Signalled to stop, or to spill
+  pthread_t thread;
+  bool running;
+  bool stop;
+  bool woken;
+  uint32_t idle; // 0 to only spill
+} packer = {.lock = PTHREAD_MUTEX_INITIALIZER,
+            .wake = PTHREAD_COND_INITIALIZER};
+
+extent *pack_extent(const extent *e) {
+  // Only the packing thread packs, one buffer will do
+  static char buffer[EXTENT_MAX_SIZE];
+
+  if (!extent_plain(e) || e->len < PACK_MIN_SIZE) {
+    return NULL;
+  }
+  // Unless it saves an eighth, the extent is better left as it is
+  size_t limit = e->len - e->len / 8;
+  size_t len = lz_compress(e->bytes, e->len, buffer,
+                           limit < sizeof(buffer) ? limit : sizeof(buffer));
+  if (len == 0) {
+    return NULL;
+  }
+  extent *packed = new_extent(len);
+  if (packed == NULL) {
+    return NULL;
+  }
+  memcpy(packed->bytes, buffer, len);
+  packed->len = e->len;
+  packed->capacity = e->len;
+  packed->packed = (uint32_t)len;
+  stat_add(STAT_EXTENTS_PACKED, 1);
+  return packed;
+}
+
+// Packed bytes only ever come from pack_extent or spill_extent
+void unpack_bytes(const extent *e, char *dest) {
+  if (e->packed == 0) {
+    spill_read(e, dest);
+    return;
+  }
+
+  char *stored = NULL;
+  if (e->spilled != 0) {
+    stored = malloc(e->packed);
+    if (stored == NULL) {
+      exit(ENOMEM);
+    }
+    spill_read(e, stored);
+  }
+  if (lz_decompress(stored != NULL ? stored : e->bytes, e->packed, dest,
+                    e->len) != 0) {
+    exit(EIO);
+  }
+  free(stored);
+}
+
+static unpacked *find_unpacked(const extent *e) {
+  for (size_t i = 0; i < PACK_CACHE_SIZE; i++) {
+    if (cache.entries[i].packed == e) {
+      return &cache.entries[i];
+    }
+  }
+  return NULL;
+}
+
+extent *unpack_extent(extent *e) {
+  pthread_mutex_lock(&cache.lock);
+  unpacked *hit = find_unpacked(e);
+  if (hit != NULL) {
+    hit->used = ++cache.uses;
+    extent *plain = hit->plain;
+    __atomic_add_fetch(&plain->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache.lock);
+    return plain;
+  }
+  pthread_mutex_unlock(&cache.lock);
+
+  // Unpacked without the lock held, whoever gets to the cache first with
+  // the same extent keeps theirs there
+  extent *plain = new_extent(e->len);
+  if (plain == NULL) {
+    exit(ENOMEM);
+  }
+  unpack_bytes(e, plain->bytes);
+  plain->len = e->len;
+  stat_add(STAT_EXTENTS_UNPACKED, 1);
+
+  pthread_mutex_lock(&cache.lock);
+  if (find_unpacked(e) == NULL) {
+    unpacked *victim = &cache.entries[0];
+    for (size_t i = 1; i < PACK_CACHE_SIZE; i++) {
+      if (cache.entries[i].used < victim->used) {
+        victim = &cache.entries[i];
+      }
+    }
+    if (victim->plain != NULL) {
+      put_extent(victim->plain);
+    }
+    __atomic_add_fetch(&plain->refs, 1, __ATOMIC_RELAXED);
+    *victim = (unpacked){e, plain, ++cache.uses};
+  }
+  pthread_mutex_unlock(&cache.lock);
+  return plain;
+}
+
+void pack_forget(extent *e) {
+  pthread_mutex_lock(&cache.lock);
+  unpacked *entry = find_unpacked(e);
+  if (entry != NULL) {
+    put_extent(entry->plain);
+    *entry = (unpacked){NULL, NULL, 0};
+  }
+  pthread_mutex_unlock(&cache.lock);
+}
+
+// A directory being walked, see walk_files
+typedef struct walk_frame {
+  directory *table;
+  size_t next;
+} walk_frame;
+
+// Call visit on every regular file, walking the tree the way find does,
+// without locks
+static void walk_files(_fs *fs, void (*visit)(inode *file, void *arg),
+                       void *arg) {
+  walk_frame *stack = malloc(sizeof(walk_frame));
+  if (stack == NULL) {
+    return;
+  }
+  size_t capacity = 1;
+  size_t depth = 1;
+  stack[0] = (walk_frame){dir_table(fs->root), 2};
+
+  while (depth > 0) {
+    walk_frame *frame = &stack[depth - 1];
+    if (frame->next >= dir_used(frame->table)) {
+      depth--;
+      continue;
+    }
+    inode *item = dir_item(&frame->table->entries[frame->next++]);
+    if (item == NULL) {
+      continue;
+    }
+
+    if (item->filetype == S_IFDIR) {
+      // Out of memory, the subtree waits for the next pass
+      if (depth == capacity) {
+        walk_frame *grown = realloc(stack, capacity * 2 * sizeof(walk_frame));
+        if (grown == NULL) {
+          continue;
+        }
+        stack = grown;
+        capacity *= 2;
+      }
+      stack[depth++] = (walk_frame){dir_table(item), 2};
+    } else if (item->filetype == S_IFREG) {
+      visit(item, arg);
+    }
+  }
+  free(stack);
+}
+
+// Swap the extents of file under its lock, unless it is gone by now.
+// Returns the bytes of memory freed.
+static size_t swap_file(inode *file, size_t (*swap)(inode *)) {
+  size_t freed = 0;
+  if (try_pin_inode(file)) {
+    lock_inode(file, true);
+    freed = swap(file);
+    unlock_inode(file);
+    unpin_inode(file);
+  }
+  return freed;
+}
+
+typedef struct pack_pass {
+  uint32_t now;
+  size_t freed;
+} pack_pass;
+
+// Files that went idle exactly now are packed. Each is looked at once per
+// idle period, so files that stay cold cost nothing after that.
+static void pack_idle_file(inode *file, void *arg) {
+  pack_pass *pass = arg;
+  if (pass->now - __atomic_load_n(&file->touched, __ATOMIC_RELAXED) ==
+      packer.idle) {
+    pass->freed += swap_file(file, file_pack);
+  }
+}
+
+typedef struct spill_candidate {
+  inode *file;
+  uint32_t age; // Passes since the contents were last used
+} spill_candidate;
+
+typedef struct spill_pass {
+  uint32_t now;
+  spill_candidate *files;
+  size_t count;
+  size_t capacity;
+} spill_pass;
+
+static void add_candidate(inode *file, void *arg) {
+  spill_pass *pass = arg;
+  if (__atomic_load_n(&file->data, __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+  if (pass->count == pass->capacity) {
+    size_t capacity = pass->capacity == 0 ? 1024 : pass->capacity * 2;
+    spill_candidate *files =
+        realloc(pass->files, capacity * sizeof(spill_candidate));
+    if (files == NULL) {
+      return;
+    }
+    pass->files = files;
+    pass->capacity = capacity;
+  }
+  uint32_t touched = __atomic_load_n(&file->touched, __ATOMIC_RELAXED);
+  pass->files[pass->count++] = (spill_candidate){file, pass->now - touched};
+}
+
+// Oldest first
+static int compare_age(const void *a, const void *b) {
+  uint32_t x = ((const spill_candidate *)a)->age;
+  uint32_t y = ((const spill_candidate *)b)->age;
+  return (x < y) - (x > y);
+}
+
+// Spill the files used least recently until excess bytes are freed. Inodes
+// are only reclaimed once the pass leaves its epoch section, so the ones
+// collected stay valid until then, though some may be unlinked by now.
+static size_t spill_coldest(_fs *fs, uint32_t now, size_t excess) {
+  spill_pass pass = {now, NULL, 0, 0};
+  walk_files(fs, add_candidate, &pass);
+  qsort(pass.files, pass.count, sizeof(spill_candidate), compare_age);
+
+  size_t freed = 0;
+  for (size_t i = 0; i < pass.count && freed < excess; i++) {
+    freed += swap_file(pass.files[i].file, file_spill);
+  }
+  free(pass.files);
+  return freed;
+}
+
+// Until the next tick, unless woken sooner. False once told to stop.
+static bool pack_wait(const struct timespec *until) {
+  pthread_mutex_lock(&packer.lock);
+  while (!packer.stop && !packer.woken &&
+         pthread_cond_timedwait(&packer.wake, &packer.lock, until) == 0) {
+  }
+  packer.woken = false;
+  bool stop = packer.stop;
+  pthread_mutex_unlock(&packer.lock);
+  return !stop;
+}
+
+static void *pack_main(void *arg) {
+  _fs *fs = arg;
+  struct timespec tick;
+  clock_gettime(CLOCK_REALTIME, &tick);
+  tick.tv_sec++;
+
+  while (pack_wait(&tick)) {
+    // The clock moves once a second, however often the thread is woken
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    bool ticked = now.tv_sec > tick.tv_sec ||
+                  (now.tv_sec == tick.tv_sec && now.tv_nsec >= tick.tv_nsec);
+    uint32_t clock = __atomic_load_n(&pack_clock, __ATOMIC_RELAXED);
+    if (ticked) {
+      clock = __atomic_add_fetch(&pack_clock, 1, __ATOMIC_RELAXED);
+      tick = now;
+      tick.tv_sec++;
+    }
+    bool pack = ticked && packer.idle > 0;
+    size_t excess = spill_excess();
+
+    pack_pass pass = {clock, 0};
+    if (pack || excess > 0) {
+      // Like a command, so save and load wait for the pass to end
+      pthread_rwlock_rdlock(&fs->lock);
+      epoch_enter();
+      if (pack) {
+        walk_files(fs, pack_idle_file, &pass);
+      }
+      if (excess > pass.freed) {
+        pass.freed += spill_coldest(fs, clock, excess - pass.freed);
+      }
+      epoch_exit();
+      pthread_rwlock_unlock(&fs->lock);
+    }
+
+    // The extents swapped out are the memory this is all about, they should
+    // not wait for commands to come along and move the epoch
+    if (pass.freed > 0) {
+      epoch_synchronize();
+    }
+    // While the budget cannot be met, the passes once a second carry on
+    // trying, without every extent allocated waking the thread up
+    if (pass.freed >= excess) {
+      spill_relieved();
+    }
+  }
+  return NULL;
+}
+
+void pack_wake(void) {
+  pthread_mutex_lock(&packer.lock);
+  packer.woken = true;
+  pthread_cond_signal(&packer.wake);
+  pthread_mutex_unlock(&packer.lock);
+}
+
+int pack_start(_fs *fs, unsigned idle) {
+  packer.idle = idle;
+  packer.stop = false;
+  int err = pthread_create(&packer.thread, NULL, pack_main, fs);
+  packer.running = err == 0;
+  return err;
+}
+
+void pack_stop(void) {
+  if (!packer.running) {
+    return;
+  }
+  pthread_mutex_lock(&packer.lock);
+  packer.stop = true;
+  pthread_cond_signal(&packer.wake);
+  pthread_mutex_unlock(&packer.lock);
+  pthread_join(packer.thread, NULL);
+  packer.running = false;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "file.h"
+#include "fs.h"
+
+#define PACK_MIN_SIZE 1024 // Extents shorter than this are not worth packing
+#define PACK_CACHE_SIZE 16 // Unpacked copies of packed extents kept around
+
+// Contents of files nobody used for a while, kept compressed in memory with
+// the codec in lz.h.
+//
+// Off unless pack_start was called. A thread then walks the tree once a
+// second and packs each file whose contents were neither read nor written
+// for the idle time: every extent only that file holds is swapped
+// for a compressed copy in its slot, the way file_pwrite swaps extents.
+// Extents shared with copies or the dedup store are left alone, packing
+// those would add a copy rather than save one.
+//
+// A packed extent keeps its len, and its capacity too so that nothing is
+// ever appended to it, but its bytes are the compressed form, packed bytes
+// long. Readers go through unpack_extent, which keeps the last few extents
+// unpacked in a cache shared by every thread. Writers copy a packed extent
+// they change, as they would a shared one, unpacking it on the way.
+
+extern uint32_t pack_clock; // Passes the packing thread made so far
+
+// Called when the contents of file are used. Stores only once per pass, so
+// readers mostly leave the inode's cache line alone.
+static inline void pack_touch(inode *file) {
+  uint32_t now = __atomic_load_n(&pack_clock, __ATOMIC_RELAXED);
+  if (__atomic_load_n(&file->touched, __ATOMIC_RELAXED) != now) {
+    __atomic_store_n(&file->touched, now, __ATOMIC_RELAXED);
+  }
+}
+
+// Start packing files of fs left alone for idle seconds, or with idle 0
+// only spilling them, see spill.h. Stop before fs is cleared, the thread
+// walks its tree.
+int pack_start(_fs *fs, unsigned idle);
+void pack_stop(void);
+// Have the thread make a pass now rather than at the next second
+void pack_wake(void);
+
+// A packed copy of e, or NULL if it is not plain, too short or does not
+// compress well enough
+extent *pack_extent(const extent *e);
+
+// The e->len bytes a packed or spilled extent holds, into dest
+void unpack_bytes(const extent *e, char *dest);
+
+// A plain copy of a packed or spilled extent, with a reference for the
+// caller
+extent *unpack_extent(extent *e);
+
+// Called by put_extent once the last reference to an extent that is not
+// plain is gone
+void pack_forget(extent *e);
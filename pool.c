@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+typedef struct task {
+  task_fn fn;
+  void *arg;
+} task;
+
+// Tasks sit in [top, bottom) of a ring, both counters only ever grow
+typedef struct deque {
+  pthread_mutex_t lock;
+  task *tasks;
+  size_t capacity;
+  size_t top;
+  size_t bottom;
+} deque;
+
+typedef struct pool_state {
+  unsigned threads;
+  unsigned started; // Worker threads running, worker 0 has none
+  pthread_t *workers;
+  deque *deques;
+  long pending;  // Spawned and not finished yet
+  long queued;   // Spawned and not picked up yet
+  long sleeping; // Workers waiting for something to be queued
+  bool stop;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_mutex_t run_lock; // Worker 0 is whoever is inside pool_run
+} pool_state;
+
+static pool_state pool = {.threads = 1,
+                          .lock = PTHREAD_MUTEX_INITIALIZER,
+                          .wake = PTHREAD_COND_INITIALIZER,
+                          .run_lock = PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local unsigned self = 0;
+static _Thread_local bool in_pool = false; // Worker, or inside pool_run
+
+static void push_bottom(deque *d, task t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top == d->capacity) {
+    size_t capacity = d->capacity == 0 ? 64 : d->capacity * 2;
+    task *tasks = malloc(capacity * sizeof(task));
+    if (tasks == NULL) {
+      exit(ENOMEM);
+    }
+    for (size_t i = d->top; i < d->bottom; i++) {
+      tasks[i % capacity] = d->tasks[i % d->capacity];
+    }
+    free(d->tasks);
+    d->tasks = tasks;
+    d->capacity = capacity;
+  }
+  d->tasks[d->bottom++ % d->capacity] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+// The owner takes its newest task, it is the one whose data is still warm
+static bool pop_bottom(deque *d, task *t) {
+  pthread_mutex_lock(&d->lock);
+  bool found = d->bottom > d->top;
+  if (found) {
+    *t = d->tasks[--d->bottom % d->capacity];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// Thieves take the oldest one, spawned highest up in the tree
+static bool steal_top(deque *d, task *t) {
+  pthread_mutex_lock(&d->lock);
+  bool found = d->bottom > d->top;
+  if (found) {
+    *t = d->tasks[d->top++ % d->capacity];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static bool find_task(task *t) {
+  bool found = pop_bottom(&pool.deques[self], t);
+  for (unsigned i = 1; !found && i < pool.threads; i++) {
+    found = steal_top(&pool.deques[(self + i) % pool.threads], t);
+  }
+  if (found) {
+    __atomic_sub_fetch(&pool.queued, 1, __ATOMIC_SEQ_CST);
+  }
+  return found;
+}
+
+static void run_task(task t) {
+  t.fn(t.arg);
+  __atomic_sub_fetch(&pool.pending, 1, __ATOMIC_RELEASE);
+}
+
+static void *worker_loop(void *arg) {
+  self = (unsigned)(uintptr_t)arg;
+  in_pool = true;
+
+  for (;;) {
+    task t;
+    if (find_task(&t)) {
+      run_task(t);
+      continue;
+    }
+
+    // Spawners only signal when they see a sleeper, so count ourselves in
+    // before the last look at the queue
+    pthread_mutex_lock(&pool.lock);
+    __atomic_add_fetch(&pool.sleeping, 1, __ATOMIC_SEQ_CST);
+    while (!pool.stop &&
+           __atomic_load_n(&pool.queued, __ATOMIC_SEQ_CST) <= 0) {
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    }
+    __atomic_sub_fetch(&pool.sleeping, 1, __ATOMIC_SEQ_CST);
+    bool stop = pool.stop;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (stop) {
+      return NULL;
+    }
+  }
+}
+
+int pool_init(unsigned threads) {
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (unsigned)cpus : 1;
+  }
+  if (threads <= 1) {
+    return 0;
+  }
+
+  pool.deques = calloc(threads, sizeof(deque));
+  pool.workers = calloc(threads, sizeof(pthread_t));
+  if (pool.deques == NULL || pool.workers == NULL) {
+    exit(ENOMEM);
+  }
+  for (unsigned i = 0; i < threads; i++) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+  }
+  pool.stop = false;
+
+  // Worker 0 is the caller of pool_run, it needs no thread of its own
+  pool.threads = threads;
+  for (pool.started = 0; pool.started + 1 < threads; pool.started++) {
+    if (pthread_create(&pool.workers[pool.started + 1], NULL, worker_loop,
+                       (void *)(uintptr_t)(pool.started + 1)) != 0) {
+      pool_shutdown();
+      return EAGAIN;
+    }
+  }
+
+  return 0;
+}
+
+void pool_shutdown(void) {
+  if (pool.deques == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.stop = true;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (unsigned i = 1; i <= pool.started; i++) {
+    pthread_join(pool.workers[i], NULL);
+  }
+  for (unsigned i = 0; i < pool.threads; i++) {
+    pthread_mutex_destroy(&pool.deques[i].lock);
+    free(pool.deques[i].tasks);
+  }
+  free(pool.deques);
+  free(pool.workers);
+  pool.deques = NULL;
+  pool.workers = NULL;
+  pool.threads = 1;
+  pool.started = 0;
+}
+
+unsigned pool_threads(void) { return pool.threads; }
+
+void pool_run(task_fn fn, void *arg) {
+  // While another thread has the pool, or from inside a task, just run it
+  if (pool.threads <= 1 || in_pool ||
+      pthread_mutex_trylock(&pool.run_lock) != 0) {
+    fn(arg);
+    return;
+  }
+
+  self = 0;
+  in_pool = true;
+  fn(arg);
+
+  // Help out until the last task spawned from here is done
+  while (__atomic_load_n(&pool.pending, __ATOMIC_ACQUIRE) > 0) {
+    task t;
+    if (find_task(&t)) {
+      run_task(t);
+    } else {
+      sched_yield();
+    }
+  }
+  in_pool = false;
+  pthread_mutex_unlock(&pool.run_lock);
+}
+
+void pool_spawn(task_fn fn, void *arg) {
+  if (!in_pool) {
+    fn(arg);
+    return;
+  }
+
+  __atomic_add_fetch(&pool.pending, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pool.queued, 1, __ATOMIC_SEQ_CST);
+  push_bottom(&pool.deques[self], (task){fn, arg});
+
+  if (__atomic_load_n(&pool.sleeping, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+// Split off no more work than the sleeping workers can pick up right away
+bool pool_wants_work(void) {
+  return in_pool &&
+         __atomic_load_n(&pool.queued, __ATOMIC_RELAXED) <
+             __atomic_load_n(&pool.sleeping, __ATOMIC_RELAXED);
+}
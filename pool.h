@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Work stealing thread pool for splitting tree walks by subdirectory.
+//
+// Every thread owns a deque of tasks: it pushes and pops its own at the
+// bottom, idle threads steal the oldest task from the top of someone else's,
+// which is usually the biggest subtree left. The thread calling pool_run takes
+// part as worker 0 and returns once every task spawned meanwhile is done. One
+// thread has the pool at a time, pool_run from any other thread meanwhile
+// simply runs its task serially.
+//
+// Tasks are only worth spawning while some worker has nothing to do, walks
+// check pool_wants_work and otherwise keep going on their own.
+
+typedef void (*task_fn)(void *arg);
+
+int pool_init(unsigned threads); // 0 picks the number of online CPUs
+void pool_shutdown(void);
+unsigned pool_threads(void);
+
+void pool_run(task_fn fn, void *arg);
+void pool_spawn(task_fn fn, void *arg);
+bool pool_wants_work(void);
@@ -0,0 +1,520 @@
+// accept4
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "epoch.h"
+#include "fs.h"
+#include "io.h"
+#include "journal.h"
+#include "server.h"
+
+#define SERVER_BACKLOG 128
+#define SERVER_EVENTS 64
+#define SESSION_READ_SIZE (64 * 1024)
+// A session runs no more commands while this much of its output waits to be
+// sent, so a client that stops reading cannot make the server hoard answers
+#define SESSION_OUTPUT_LIMIT (4 * 1024 * 1024)
+
+typedef struct session {
+  int fd;
+  char *dir; // Working directory, absolute and without . or ..
+  size_t dir_len;
+  char *in; // Bytes received, [start, end) not run yet
+  size_t in_capacity;
+  size_t start;
+  size_t end;
+  size_t scanned; // Bytes after start already known to hold no newline
+  out_buffer out; // Responses, [sent, out.len) still has to go out
+  size_t sent;
+  uint32_t events; // What epoll watches for
+  bool eof;        // The client is done sending
+  bool closing;    // The client sent exit
+  struct session *prev;
+  struct session *next;
+} session;
+
+typedef struct server_state {
+  int listener;
+  bool bound; // The socket file is ours to remove
+  int epoll;
+  int wake[2]; // Written to by the signal handler
+  _fs *fs;
+  int (*exec)(char *line);
+  session *sessions;
+  char *journal_dir; // Last cd record logged, NULL if replay could be anywhere
+} server_state;
+
+static server_state server = {.listener = -1, .epoll = -1, .wake = {-1, -1}};
+
+static void on_signal(int sig) {
+  (void)sig;
+  int saved = errno;
+  char byte = 0;
+  if (write(server.wake[1], &byte, 1) < 0) {
+    // Already woken up
+  }
+  errno = saved;
+}
+
+static bool is_command(const char *line, const char *name) {
+  size_t len = strcspn(line, " ");
+  return strlen(name) == len && strncmp(line, name, len) == 0;
+}
+
+static size_t pending(const session *s) { return s->out.len - s->sent; }
+
+// Set the session's directory to where path leads from it, by name: . and ..
+// are folded away, like the lookup that checked path did
+static void join_dir(session *s, const char *path) {
+  size_t base = path[0] == '/' ? 1 : s->dir_len;
+  char *dir = malloc(base + strlen(path) + 2);
+  if (dir == NULL) {
+    exit(ENOMEM);
+  }
+  memcpy(dir, path[0] == '/' ? "/" : s->dir, base);
+
+  size_t len = base;
+  while (*path != '\0') {
+    path += strspn(path, "/");
+    size_t n = strcspn(path, "/");
+    if (n == 2 && path[0] == '.' && path[1] == '.') {
+      while (len > 1 && dir[len - 1] != '/') {
+        len--;
+      }
+      if (len > 1) {
+        len--;
+      }
+    } else if (n > 0 && !(n == 1 && path[0] == '.')) {
+      if (len > 1) {
+        dir[len++] = '/';
+      }
+      memcpy(dir + len, path, n);
+      len += n;
+    }
+    path += n;
+  }
+  dir[len] = '\0';
+
+  free(s->dir);
+  s->dir = dir;
+  s->dir_len = len;
+}
+
+// The session's directory, or / if another client removed it meanwhile
+static inode *session_dir(session *s) {
+  _fs *fs = server.fs;
+  inode *dir = fs->root;
+  if (s->dir_len > 1 &&
+      (resolve_path(fs, s->dir, &dir) != 0 || dir->filetype != S_IFDIR)) {
+    join_dir(s, "/");
+    dir = fs->root;
+  }
+  return dir;
+}
+
+// cd only ever lands on a directory, a bad path leaves the session where it
+// was
+static void change_dir(session *s, char *line) {
+  char *save_ptr = NULL;
+  strtok_r(line, " ", &save_ptr);
+  char *path = strtok_r(NULL, " ", &save_ptr);
+  if (path == NULL) {
+    join_dir(s, "/");
+    return;
+  }
+
+  _fs *fs = server.fs;
+  pthread_rwlock_rdlock(&fs->lock);
+  inode *target = NULL;
+  if (resolve_path(fs, path, &target) == 0 && target->filetype == S_IFDIR) {
+    join_dir(s, path);
+  }
+  pthread_rwlock_unlock(&fs->lock);
+}
+
+// Replay has a single working directory, moved by the cd records of the
+// journal. Before a command of this session is logged, a cd to its directory
+// is, unless the last one logged already went there.
+static void journal_dir(const session *s) {
+  if (server.journal_dir != NULL &&
+      strcmp(server.journal_dir + 3, s->dir) == 0) {
+    return;
+  }
+
+  char *record = malloc(s->dir_len + 4);
+  if (record == NULL) {
+    exit(ENOMEM);
+  }
+  memcpy(record, "cd ", 3);
+  memcpy(record + 3, s->dir, s->dir_len + 1);
+  int err = journal_append(record);
+  if (err != 0) {
+    fprintf(stderr, "journal: %s\n", strerror(err));
+    exit(err);
+  }
+
+  free(server.journal_dir);
+  server.journal_dir = record;
+}
+
+static void run_line(session *s, char *line) {
+  line += strspn(line, " ");
+  out_capture(&s->out);
+
+  // Only this thread issues commands, so the directory looked up here is
+  // still the session's when the command runs. The section keeps it
+  // allocated even if the command removes it.
+  epoch_enter();
+  use_working_dir(session_dir(s));
+  if (is_command(line, "cd")) {
+    change_dir(s, line);
+  } else if (is_command(line, "exit")) {
+    s->closing = true;
+  } else {
+    if (journal_enabled() && journal_records(line)) {
+      journal_dir(s);
+    }
+    // Replay starts from wherever these leave the shell's directory
+    bool moves_replay =
+        is_command(line, "load") || is_command(line, "checkpoint");
+    server.exec(line);
+    if (moves_replay) {
+      free(server.journal_dir);
+      server.journal_dir = NULL;
+    }
+  }
+  use_working_dir(NULL);
+  epoch_exit();
+
+  out_char('\0');
+  out_capture(NULL);
+}
+
+// Next complete line, NUL terminated in place. Once the client is done
+// sending, whatever is left counts as a last line.
+static char *next_line(session *s) {
+  char *line = s->in + s->start;
+  if (s->start == s->end) {
+    return NULL;
+  }
+
+  char *newline =
+      memchr(line + s->scanned, '\n', s->end - s->start - s->scanned);
+  if (newline == NULL) {
+    s->scanned = s->end - s->start;
+    if (!s->eof) {
+      return NULL;
+    }
+    // Reading always leaves a spare byte for this
+    newline = s->in + s->end;
+  }
+
+  *newline = '\0';
+  s->start = newline == s->in + s->end ? s->end
+                                       : (size_t)(newline - s->in) + 1;
+  s->scanned = 0;
+  return line;
+}
+
+static void run_lines(session *s) {
+  while (!s->closing && pending(s) <= SESSION_OUTPUT_LIMIT) {
+    char *line = next_line(s);
+    if (line == NULL) {
+      return;
+    }
+    run_line(s, line);
+  }
+}
+
+// Read what the client sent, false if the connection broke
+static bool fill_session(session *s) {
+  if (s->start > 0) {
+    memmove(s->in, s->in + s->start, s->end - s->start);
+    s->end -= s->start;
+    s->start = 0;
+  }
+  if (s->in_capacity - s->end < SESSION_READ_SIZE + 1) {
+    size_t capacity = s->in_capacity == 0 ? SESSION_READ_SIZE + 1
+                                          : s->in_capacity * 2;
+    char *in = realloc(s->in, capacity);
+    if (in == NULL) {
+      exit(ENOMEM);
+    }
+    s->in = in;
+    s->in_capacity = capacity;
+  }
+
+  ssize_t got = 0;
+  do {
+    got = recv(s->fd, s->in + s->end, s->in_capacity - s->end - 1, 0);
+  } while (got < 0 && errno == EINTR);
+
+  if (got < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  if (got == 0) {
+    s->eof = true;
+  }
+  s->end += (size_t)got;
+  return true;
+}
+
+// Send as much of the responses as the socket takes, false if the
+// connection broke
+static bool flush_session(session *s) {
+  while (pending(s) > 0) {
+    ssize_t sent =
+        send(s->fd, s->out.data + s->sent, pending(s), MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+      }
+      break;
+    }
+    s->sent += (size_t)sent;
+  }
+
+  // Keep the buffer from creeping along while the client lags behind
+  if (pending(s) == 0) {
+    s->out.len = 0;
+    s->sent = 0;
+  } else if (s->sent >= s->out.len / 2) {
+    memmove(s->out.data, s->out.data + s->sent, pending(s));
+    s->out.len -= s->sent;
+    s->sent = 0;
+  }
+  return true;
+}
+
+static void close_session(session *s) {
+  epoll_ctl(server.epoll, EPOLL_CTL_DEL, s->fd, NULL);
+  close(s->fd);
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    server.sessions = s->next;
+  }
+  if (s->next != NULL) {
+    s->next->prev = s->prev;
+  }
+  free(s->dir);
+  free(s->in);
+  free(s->out.data);
+  free(s);
+}
+
+// Run whatever the session has ready, send the responses and decide what to
+// wait for next
+static void service(session *s) {
+  bool blocked = false;
+  do {
+    run_lines(s);
+    blocked = pending(s) > SESSION_OUTPUT_LIMIT;
+    if (!flush_session(s)) {
+      close_session(s);
+      return;
+    }
+  } while (blocked && pending(s) <= SESSION_OUTPUT_LIMIT);
+
+  bool done = s->closing || (s->eof && s->start == s->end);
+  if (done && pending(s) == 0) {
+    close_session(s);
+    return;
+  }
+
+  uint32_t events = 0;
+  if (!done && !s->eof && pending(s) <= SESSION_OUTPUT_LIMIT) {
+    events |= EPOLLIN;
+  }
+  if (pending(s) > 0) {
+    events |= EPOLLOUT;
+  }
+  if (events != s->events) {
+    struct epoll_event event = {.events = events, .data.ptr = s};
+    epoll_ctl(server.epoll, EPOLL_CTL_MOD, s->fd, &event);
+    s->events = events;
+  }
+}
+
+static void session_event(session *s, uint32_t events) {
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !s->eof &&
+      !s->closing && !fill_session(s)) {
+    close_session(s);
+    return;
+  }
+  service(s);
+}
+
+static void accept_clients(void) {
+  for (;;) {
+    int fd = accept4(server.listener, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+
+    session *s = calloc(1, sizeof(session));
+    if (s == NULL) {
+      exit(ENOMEM);
+    }
+    s->fd = fd;
+    join_dir(s, "/");
+    s->events = EPOLLIN;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = s};
+    if (epoll_ctl(server.epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+      close(fd);
+      free(s->dir);
+      free(s);
+      continue;
+    }
+
+    s->next = server.sessions;
+    if (server.sessions != NULL) {
+      server.sessions->prev = s;
+    }
+    server.sessions = s;
+  }
+}
+
+// Bind the listening socket. A socket file nobody answers on any more is a
+// leftover of a server that died, it is replaced.
+static int listen_on(const char *path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return ENAMETOOLONG;
+  }
+  strcpy(address.sun_path, path);
+
+  server.listener =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server.listener < 0) {
+    return errno;
+  }
+
+  int err = 0;
+  if (bind(server.listener, (struct sockaddr *)&address, sizeof(address)) !=
+      0) {
+    err = errno;
+  }
+  if (err == EADDRINUSE) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&address,
+                              sizeof(address)) != 0 &&
+        errno == ECONNREFUSED && unlink(path) == 0) {
+      err = bind(server.listener, (struct sockaddr *)&address,
+                 sizeof(address)) == 0
+                ? 0
+                : errno;
+    }
+    if (probe >= 0) {
+      close(probe);
+    }
+  }
+  server.bound = err == 0;
+  if (err == 0 && listen(server.listener, SERVER_BACKLOG) != 0) {
+    err = errno;
+  }
+  return err;
+}
+
+static int start(const char *path) {
+  int err = listen_on(path);
+  if (err != 0) {
+    return err;
+  }
+
+  server.epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (server.epoll < 0 ||
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                 server.wake) != 0) {
+    return errno;
+  }
+
+  struct epoll_event listener = {.events = EPOLLIN,
+                                 .data.ptr = &server.listener};
+  struct epoll_event wake = {.events = EPOLLIN, .data.ptr = server.wake};
+  if (epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.listener, &listener) !=
+          0 ||
+      epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.wake[0], &wake) != 0) {
+    return errno;
+  }
+
+  struct sigaction action = {.sa_handler = on_signal, .sa_flags = SA_RESTART};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  return 0;
+}
+
+static void stop(const char *path) {
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  while (server.sessions != NULL) {
+    close_session(server.sessions);
+  }
+  int *fds[] = {&server.listener, &server.epoll, &server.wake[0],
+                &server.wake[1]};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (*fds[i] >= 0) {
+      close(*fds[i]);
+      *fds[i] = -1;
+    }
+  }
+  if (server.bound) {
+    unlink(path);
+    server.bound = false;
+  }
+  free(server.journal_dir);
+  server.journal_dir = NULL;
+}
+
+int serve(_fs *fs, const char *path, int (*exec)(char *line)) {
+  server.fs = fs;
+  server.exec = exec;
+  int err = start(path);
+
+  struct epoll_event events[SERVER_EVENTS];
+  bool running = err == 0;
+  while (running) {
+    int count = epoll_wait(server.epoll, events, SERVER_EVENTS, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err = errno;
+      break;
+    }
+
+    for (int i = 0; i < count; i++) {
+      void *source = events[i].data.ptr;
+      if (source == &server.listener) {
+        accept_clients();
+      } else if (source == server.wake) {
+        running = false;
+      } else {
+        session_event(source, events[i].events);
+      }
+    }
+  }
+
+  stop(path);
+  return err;
+}
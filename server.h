@@ -0,0 +1,17 @@
+#pragma once
+
+#include "fs.h"
+
+// Daemon mode: one in-memory tree served to any number of clients on a Unix
+// domain socket, multiplexed with epoll on the calling thread.
+//
+// Clients send commands one per line, like on stdin, and may send as many as
+// they like without waiting for answers. Every line gets exactly one
+// response, in the order the lines were sent: whatever the command printed,
+// followed by a NUL byte. Each session starts in / and has a working
+// directory of its own, exit ends it. Commands that would end the shell on
+// an error report it to their client instead, see exec.
+//
+// Runs until SIGINT or SIGTERM. A socket left behind by a server that died is
+// replaced, one that still answers is not. exec runs a line on fs.
+int serve(_fs *fs, const char *path, int (*exec)(char *line));
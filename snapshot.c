@@ -0,0 +1,476 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dir.h"
+#include "file.h"
+#include "fs.h"
+#include "pack.h"
+#include "snapshot.h"
+#include "stats.h"
+
+#define ALIGN4(n) (((n) + 3) & ~(uint64_t)3)
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+// Extents in the image carry one reference for the mapping itself, which is
+// never dropped, so put_extent can never try to free() them
+#define IMAGE_EXTENT_REFS 2
+
+// Remembers which inode was saved first with a shared file_data
+typedef struct owner_map {
+  const file_data **keys;
+  uint32_t *owners;
+  size_t mask;
+} owner_map;
+
+static size_t hash_pointer(const void *ptr, size_t mask) {
+  return (size_t)(((uintptr_t)ptr >> 4) * 2654435761u) & mask;
+}
+
+// Return the owner of f, recording owner as the owner if f is new
+static uint32_t find_owner(owner_map *map, const file_data *f, uint32_t owner) {
+  size_t i = hash_pointer(f, map->mask);
+  while (map->keys[i] != NULL) {
+    if (map->keys[i] == f) {
+      return map->owners[i];
+    }
+    i = (i + 1) & map->mask;
+  }
+  map->keys[i] = f;
+  map->owners[i] = owner;
+  return owner;
+}
+
+static uint64_t extent_record_size(uint64_t len) {
+  return ALIGN4(sizeof(extent) + len);
+}
+
+static int write_image(_fs *fs, FILE *out, const snapshot_header *header,
+                       const snapshot_inode *records, const uint32_t *numbers) {
+  static const char padding[8] = {0};
+  inode_table *table = &fs->inodes;
+
+  if (fwrite(header, sizeof(*header), 1, out) != 1 ||
+      fwrite(records, sizeof(*records), header->inode_count, out) !=
+          header->inode_count) {
+    return EIO;
+  }
+
+  for (size_t i = 0; i < header->handle_count; i++) {
+    const handle *h = &fs->handles.slots[i];
+    snapshot_handle record = {
+        h->node != NULL ? numbers[h->node->ino] : SNAPSHOT_CLOSED,
+        h->generation};
+    if (fwrite(&record, sizeof(record), 1, out) != 1) {
+      return EIO;
+    }
+  }
+
+  // Directory entries, in inode order
+  for (size_t i = 0; i < table->next; i++) {
+    inode *node = get_inode(fs, (uint32_t)i);
+    if (node == NULL || node->filetype != S_IFDIR) {
+      continue;
+    }
+    directory *d = dir_table(node);
+    for (size_t j = 0; j < dir_used(d); j++) {
+      if (d->entries[j].item == NULL) {
+        continue;
+      }
+      snapshot_entry entry;
+      memset(&entry, 0, sizeof(entry));
+      entry.ino = numbers[d->entries[j].item->ino];
+      strcpy(entry.name, d->entries[j].name);
+      if (fwrite(&entry, sizeof(entry), 1, out) != 1) {
+        return EIO;
+      }
+    }
+  }
+
+  size_t pad = header->extents_offset - header->entries_offset -
+               header->entry_count * sizeof(snapshot_entry);
+  if (fwrite(padding, 1, pad, out) != pad) {
+    return EIO;
+  }
+
+  // Extent table first, then the extents themselves, for every file that
+  // owns its contents
+  for (int pass = 0; pass < 2; pass++) {
+    uint64_t offset = header->data_offset;
+    for (size_t i = 0; i < table->next; i++) {
+      inode *node = get_inode(fs, (uint32_t)i);
+      if (node == NULL || node->filetype == S_IFDIR ||
+          records[numbers[i]].data_owner != numbers[i]) {
+        continue;
+      }
+
+      file_data *f = node->data;
+      for (size_t j = 0; j < f->count; j++) {
+        extent *e = f->extents[j];
+        bool ok = true;
+        if (pass == 0) {
+          snapshot_extent record = {offset, e->len};
+          ok = fwrite(&record, sizeof(record), 1, out) == 1;
+        } else {
+          // Saved plain, the image is used in place once loaded
+          extent copy = {e->len, e->len, IMAGE_EXTENT_REFS, 0, 0, 0};
+          extent *plain = extent_plain(e) ? e : unpack_extent(e);
+          pad = extent_record_size(e->len) - sizeof(extent) - e->len;
+          ok = fwrite(&copy, sizeof(copy), 1, out) == 1 &&
+               fwrite(plain->bytes, 1, e->len, out) == e->len &&
+               fwrite(padding, 1, pad, out) == pad;
+          if (plain != e) {
+            put_extent(plain);
+          }
+        }
+        if (!ok) {
+          return EIO;
+        }
+        offset += extent_record_size(e->len);
+      }
+    }
+  }
+
+  return 0;
+}
+
+int save_fs(_fs *fs, const char *file, uint64_t sequence) {
+  inode_table *table = &fs->inodes;
+
+  // Inodes unlinked but not reclaimed yet would be saved as well. The whole
+  // tree is ours while saving, so they can go now.
+  reclaim_fs(fs);
+
+  // Live inodes get dense numbers in table order, numbers maps table slots
+  // to them
+  uint32_t *numbers = malloc(table->next * sizeof(uint32_t));
+  snapshot_inode *records = calloc(table->next, sizeof(snapshot_inode));
+  size_t map_size = 16;
+  while (map_size < table->next * 2) {
+    map_size *= 2;
+  }
+  owner_map map = {calloc(map_size, sizeof(file_data *)),
+                   calloc(map_size, sizeof(uint32_t)), map_size - 1};
+  if (numbers == NULL || records == NULL || map.keys == NULL ||
+      map.owners == NULL) {
+    free(numbers);
+    free(records);
+    free(map.keys);
+    free(map.owners);
+    return ENOMEM;
+  }
+
+  snapshot_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.sequence = sequence;
+
+  uint64_t data_len = 0;
+  uint32_t n = 0;
+  for (size_t i = 0; i < table->next; i++) {
+    inode *node = get_inode(fs, (uint32_t)i);
+    if (node == NULL) {
+      continue;
+    }
+
+    snapshot_inode *r = &records[n];
+    r->filetype = (uint8_t)node->filetype;
+    r->reference_count = node->reference_count;
+    r->data_size = node->data_size;
+    r->data_owner = SNAPSHOT_NO_DATA;
+
+    if (node->filetype == S_IFDIR) {
+      r->count = (uint32_t)dir_count(node);
+      r->first = header.entry_count;
+      header.entry_count += r->count;
+    } else if (node->data != NULL) {
+      // Contents shared copy on write are only saved once
+      file_data *f = node->data;
+      r->data_owner = f->refs > 1 ? find_owner(&map, f, n) : n;
+      if (r->data_owner != n) {
+        r->count = records[r->data_owner].count;
+        r->first = records[r->data_owner].first;
+      } else {
+        r->count = (uint32_t)f->count;
+        r->first = header.extent_count;
+        header.extent_count += f->count;
+        for (size_t j = 0; j < f->count; j++) {
+          data_len += extent_record_size(f->extents[j]->len);
+        }
+      }
+    }
+
+    numbers[i] = n++;
+  }
+
+  header.inode_count = n;
+  header.root = numbers[fs->root->ino];
+  header.cwd = fs->working_dir->allocated ? numbers[fs->working_dir->ino]
+                                         : header.root;
+  header.handle_count = (uint32_t)fs->handles.capacity;
+  header.entries_offset = sizeof(header) + n * sizeof(snapshot_inode) +
+                          header.handle_count * sizeof(snapshot_handle);
+  header.extents_offset = ALIGN8(header.entries_offset +
+                                 header.entry_count * sizeof(snapshot_entry));
+  header.data_offset =
+      header.extents_offset + header.extent_count * sizeof(snapshot_extent);
+  header.size = header.data_offset + data_len;
+
+  // Write next to the target and rename, so a failed save never leaves a
+  // truncated image behind. The image must be on disk before the rename, a
+  // checkpoint drops the journal right after.
+  char *tmp = malloc(strlen(file) + 5);
+  int err = tmp == NULL ? ENOMEM : 0;
+  FILE *out = NULL;
+  if (err == 0) {
+    sprintf(tmp, "%s.tmp", file);
+    out = fopen(tmp, "wb");
+    err = out == NULL ? errno : 0;
+  }
+  if (err == 0) {
+    err = write_image(fs, out, &header, records, numbers);
+  }
+  if (err == 0 && (fflush(out) != 0 || fsync(fileno(out)) != 0)) {
+    err = errno;
+  }
+  if (out != NULL && fclose(out) != 0 && err == 0) {
+    err = errno;
+  }
+  if (err == 0 && rename(tmp, file) != 0) {
+    err = errno;
+  }
+  if (err != 0 && out != NULL) {
+    remove(tmp);
+  }
+
+  free(tmp);
+  free(numbers);
+  free(records);
+  free(map.keys);
+  free(map.owners);
+  return err;
+}
+
+// Make sure every count, index and offset in the image stays inside it
+static int check_image(const char *image, size_t size) {
+  const snapshot_header *h = (const snapshot_header *)image;
+  if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != SNAPSHOT_VERSION || h->size != size ||
+      h->inode_count == 0 || h->root >= h->inode_count ||
+      h->cwd >= h->inode_count || h->handle_count > HANDLE_MAX) {
+    return EINVAL;
+  }
+
+  if (h->entry_count > size / sizeof(snapshot_entry) ||
+      h->extent_count > size / sizeof(snapshot_extent) ||
+      h->entries_offset !=
+          sizeof(*h) + (uint64_t)h->inode_count * sizeof(snapshot_inode) +
+              (uint64_t)h->handle_count * sizeof(snapshot_handle) ||
+      h->extents_offset < h->entries_offset +
+                              h->entry_count * sizeof(snapshot_entry) ||
+      h->extents_offset % 8 != 0 ||
+      h->data_offset !=
+          h->extents_offset + h->extent_count * sizeof(snapshot_extent) ||
+      h->data_offset > size) {
+    return EINVAL;
+  }
+
+  const snapshot_inode *records =
+      (const snapshot_inode *)(image + sizeof(*h));
+  const snapshot_handle *handles =
+      (const snapshot_handle *)(records + h->inode_count);
+  const snapshot_entry *entries =
+      (const snapshot_entry *)(image + h->entries_offset);
+  const snapshot_extent *extents =
+      (const snapshot_extent *)(image + h->extents_offset);
+
+  for (uint32_t i = 0; i < h->handle_count; i++) {
+    if (handles[i].ino != SNAPSHOT_CLOSED &&
+        (handles[i].ino >= h->inode_count ||
+         records[handles[i].ino].filetype != S_IFREG)) {
+      return EINVAL;
+    }
+  }
+
+  for (uint32_t n = 0; n < h->inode_count; n++) {
+    const snapshot_inode *r = &records[n];
+    if (r->filetype == S_IFDIR) {
+      if (r->count < 2 || r->first > h->entry_count ||
+          r->count > h->entry_count - r->first) {
+        return EINVAL;
+      }
+      for (uint64_t j = r->first; j < r->first + r->count; j++) {
+        if (entries[j].ino >= h->inode_count ||
+            memchr(entries[j].name, '\0', sizeof(entries[j].name)) == NULL) {
+          return EINVAL;
+        }
+      }
+    } else if (r->filetype != S_IFREG) {
+      return EINVAL;
+    } else if (r->data_owner == n) {
+      if (r->first > h->extent_count || r->count > h->extent_count - r->first) {
+        return EINVAL;
+      }
+      for (uint64_t j = r->first; j < r->first + r->count; j++) {
+        if (extents[j].offset < h->data_offset || extents[j].offset % 4 != 0 ||
+            extents[j].len > UINT32_MAX ||
+            extents[j].offset > size - sizeof(extent) ||
+            extents[j].len > size - sizeof(extent) - extents[j].offset) {
+          return EINVAL;
+        }
+      }
+    } else if (r->data_owner != SNAPSHOT_NO_DATA &&
+               (r->data_owner > n ||
+                records[r->data_owner].filetype != S_IFREG ||
+                records[r->data_owner].data_owner != r->data_owner)) {
+      return EINVAL;
+    }
+  }
+
+  if (records[h->root].filetype != S_IFDIR ||
+      records[h->cwd].filetype != S_IFDIR) {
+    return EINVAL;
+  }
+  return 0;
+}
+
+// Rebuild the inode graph from a checked image. File extents are not copied,
+// they are used straight from the mapping.
+static void build_fs(_fs *fs, char *image) {
+  const snapshot_header *h = (const snapshot_header *)image;
+  const snapshot_inode *records =
+      (const snapshot_inode *)(image + sizeof(*h));
+  const snapshot_entry *entries =
+      (const snapshot_entry *)(image + h->entries_offset);
+  const snapshot_extent *extents =
+      (const snapshot_extent *)(image + h->extents_offset);
+
+  inode **nodes = malloc(h->inode_count * sizeof(inode *));
+  if (nodes == NULL) {
+    exit(ENOMEM);
+  }
+  for (uint32_t n = 0; n < h->inode_count; n++) {
+    nodes[n] = alloc_inode(fs);
+    if (nodes[n] == NULL) {
+      exit(ENOMEM);
+    }
+    nodes[n]->filetype = (ftype)records[n].filetype;
+    nodes[n]->reference_count = records[n].reference_count;
+  }
+
+  for (uint32_t n = 0; n < h->inode_count; n++) {
+    const snapshot_inode *r = &records[n];
+    inode *node = nodes[n];
+
+    if (r->filetype == S_IFDIR) {
+      for (uint64_t j = r->first; j < r->first + r->count; j++) {
+        if (dir_insert(node, entries[j].name, nodes[entries[j].ino]) ==
+            ENOMEM) {
+          exit(ENOMEM);
+        }
+      }
+    } else if (r->data_owner != SNAPSHOT_NO_DATA && r->data_owner != n) {
+      file_copy(node, nodes[r->data_owner]);
+    } else if (r->data_owner == n) {
+      file_data *f = calloc(1, sizeof(file_data));
+      if (f == NULL || (r->count > 0 &&
+                        (f->extents = malloc(r->count * sizeof(extent *))) ==
+                            NULL)) {
+        exit(ENOMEM);
+      }
+      for (uint32_t j = 0; j < r->count; j++) {
+        f->extents[j] = (extent *)(image + extents[r->first + j].offset);
+      }
+      f->count = r->count;
+      f->capacity = r->count;
+      f->refs = 1;
+      f->image = fs->image;
+      fs->image->refs++;
+      node->data = f;
+      node->data_size = r->data_size;
+      stat_add(STAT_LOGICAL_BYTES, r->data_size);
+    }
+  }
+
+  // The handles' references are part of the saved counts already
+  const snapshot_handle *handles =
+      (const snapshot_handle *)(records + h->inode_count);
+  if (h->handle_count > 0) {
+    fs->handles.slots = malloc(h->handle_count * sizeof(handle));
+    if (fs->handles.slots == NULL) {
+      exit(ENOMEM);
+    }
+    fs->handles.capacity = h->handle_count;
+  }
+  for (uint32_t i = 0; i < h->handle_count; i++) {
+    fs->handles.slots[i] = (handle){
+        handles[i].ino != SNAPSHOT_CLOSED ? nodes[handles[i].ino] : NULL,
+        handles[i].generation};
+  }
+
+  fs->root = nodes[h->root];
+  fs->working_dir = nodes[h->cwd];
+  free(nodes);
+}
+
+int load_fs(_fs *fs, const char *file, uint64_t *sequence) {
+  // fcntl.h and sys/stat.h clash with our own S_IF* names, stdio is enough
+  // to open and size the file
+  FILE *in = fopen(file, "rb");
+  if (in == NULL) {
+    return errno;
+  }
+  if (fseek(in, 0, SEEK_END) != 0) {
+    int err = errno;
+    fclose(in);
+    return err;
+  }
+  long end = ftell(in);
+  if (end < (long)sizeof(snapshot_header)) {
+    fclose(in);
+    return EINVAL;
+  }
+
+  // Private mapping, so reference counts in extent headers can be updated in
+  // place without ever touching the file
+  size_t size = (size_t)end;
+  char *image =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(in), 0);
+  fclose(in);
+  if (image == MAP_FAILED) {
+    return errno;
+  }
+
+  int err = check_image(image, size);
+  if (err != 0) {
+    munmap(image, size);
+    return err;
+  }
+
+  mapping *map = malloc(sizeof(mapping));
+  if (map == NULL) {
+    exit(ENOMEM);
+  }
+  *map = (mapping){image, size, 1};
+  stat_add(STAT_PHYSICAL_BYTES, size);
+
+  // The image replaces the current tree entirely
+  clear_fs(fs);
+  fs->image = map;
+  build_fs(fs, image);
+  if (sequence != NULL) {
+    *sequence = ((const snapshot_header *)image)->sequence;
+  }
+  return 0;
+}
+
+void unmap_image(_fs *fs) {
+  if (fs->image != NULL) {
+    mapping_put(fs->image);
+    fs->image = NULL;
+  }
+}
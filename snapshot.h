@@ -0,0 +1,75 @@
+#pragma once
+
+#include "fs.h"
+
+#define SNAPSHOT_MAGIC "FSIMAGE"
+#define SNAPSHOT_VERSION 6
+
+// On disk layout, in host byte order. Every reference inside the image is an
+// inode number, an index or a byte offset from the start of the file, so the
+// image can be mapped anywhere and used in place.
+//
+//   snapshot_header
+//   snapshot_inode[inode_count]     indexed by inode number
+//   snapshot_handle[handle_count]   descriptor slots, see handle_table
+//   snapshot_entry[entry_count]     directory entries, "." and ".." included
+//   snapshot_extent[extent_count]   where each file extent lives
+//   extents                         laid out exactly like struct extent, each
+//                                   padded to a 4 byte boundary
+typedef struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t inode_count;
+  uint32_t root;
+  uint32_t cwd;
+  uint32_t handle_count;
+  uint32_t pad;
+  uint64_t sequence; // Last journal record contained in the image
+  uint64_t entry_count;
+  uint64_t extent_count;
+  uint64_t entries_offset;
+  uint64_t extents_offset;
+  uint64_t data_offset;
+  uint64_t size;
+} snapshot_header;
+
+#define SNAPSHOT_NO_DATA UINT32_MAX
+
+typedef struct snapshot_inode {
+  uint8_t filetype;
+  uint8_t pad[3];
+  uint32_t reference_count; // Open handles included
+  // Directories: number of entries. Files: number of extents
+  uint32_t count;
+  // Files: inode whose extents hold the contents, which is the inode itself
+  // unless contents are shared copy on write with an earlier one.
+  // SNAPSHOT_NO_DATA for files that were never written
+  uint32_t data_owner;
+  uint32_t pad2;
+  // Directories: index of the first entry. Files: index of the first extent
+  uint64_t first;
+  uint64_t data_size;
+} snapshot_inode;
+
+#define SNAPSHOT_CLOSED UINT32_MAX
+
+// Open handles are saved along with the tree, so descriptors a journal
+// replayed on top of the image refers to are open again
+typedef struct snapshot_handle {
+  uint32_t ino; // SNAPSHOT_CLOSED for a free slot
+  uint32_t generation;
+} snapshot_handle;
+
+typedef struct snapshot_entry {
+  uint32_t ino;
+  char name[sizeof(((DIR_ENTRY *)NULL)->name)];
+} snapshot_entry;
+
+typedef struct snapshot_extent {
+  uint64_t offset;
+  uint64_t len;
+} snapshot_extent;
+
+int save_fs(_fs *fs, const char *file, uint64_t sequence);
+int load_fs(_fs *fs, const char *file, uint64_t *sequence);
+void unmap_image(_fs *fs);
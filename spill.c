@@ -0,0 +1,195 @@
+// asprintf
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "lz.h"
+#include "pack.h"
+#include "spill.h"
+#include "stats.h"
+
+// Runs of slots an extent can take, from one to all of EXTENT_MAX_SIZE
+#define SPILL_RUNS (EXTENT_MAX_SIZE / SPILL_SLOT_SIZE)
+
+bool spill_enabled = false;
+uint64_t spill_resident = 0;
+
+// First slots of free runs of one length
+typedef struct spill_runs {
+  uint32_t *slots;
+  size_t count;
+  size_t capacity;
+} spill_runs;
+
+// Freed runs are kept by length and each extent goes back to one exactly its
+// size, the file only grows when there is none. Extents are at most 64 KiB,
+// so that wastes little, and spilling takes no search.
+static struct {
+  pthread_mutex_t lock;
+  int fd;
+  size_t budget;
+  bool woken; // The packing thread was woken and is not through yet
+  uint32_t end; // Slots in the file
+  spill_runs free[SPILL_RUNS];
+} spill = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+int spill_start(size_t budget, const char *dir) {
+  char *path = NULL;
+  if (asprintf(&path, "%s/spill.XXXXXX", dir) < 0) {
+    return ENOMEM;
+  }
+  spill.fd = mkstemp(path);
+  int err = spill.fd < 0 ? errno : 0;
+  if (err == 0) {
+    unlink(path);
+    spill.budget = budget;
+    spill_enabled = true;
+  }
+  free(path);
+  return err;
+}
+
+void spill_check(uint64_t resident) {
+  if (resident > spill.budget &&
+      !__atomic_load_n(&spill.woken, __ATOMIC_RELAXED) &&
+      !__atomic_exchange_n(&spill.woken, true, __ATOMIC_RELAXED)) {
+    pack_wake();
+  }
+}
+
+size_t spill_excess(void) {
+  if (!spill_enabled) {
+    return 0;
+  }
+  uint64_t resident = __atomic_load_n(&spill_resident, __ATOMIC_RELAXED);
+  size_t target = spill.budget - spill.budget / 8;
+  return resident > spill.budget ? resident - target : 0;
+}
+
+void spill_relieved(void) {
+  __atomic_store_n(&spill.woken, false, __ATOMIC_RELAXED);
+}
+
+static size_t stored_size(const extent *e) {
+  return e->packed != 0 ? e->packed : e->len;
+}
+
+static size_t run_length(size_t size) {
+  return (size + SPILL_SLOT_SIZE - 1) / SPILL_SLOT_SIZE;
+}
+
+// First slot of a free run of length slots, UINT32_MAX if the file is full
+static uint32_t take_run(size_t length) {
+  pthread_mutex_lock(&spill.lock);
+  spill_runs *runs = &spill.free[length - 1];
+  uint32_t slot = UINT32_MAX;
+  if (runs->count > 0) {
+    slot = runs->slots[--runs->count];
+  } else if (spill.end <= UINT32_MAX - 1 - length) {
+    slot = spill.end;
+    spill.end += (uint32_t)length;
+  }
+  pthread_mutex_unlock(&spill.lock);
+  return slot;
+}
+
+// Out of memory, the run is lost until the process ends
+static void give_run(uint32_t slot, size_t length) {
+  pthread_mutex_lock(&spill.lock);
+  spill_runs *runs = &spill.free[length - 1];
+  if (runs->count == runs->capacity) {
+    size_t capacity = runs->capacity == 0 ? 64 : runs->capacity * 2;
+    uint32_t *slots = realloc(runs->slots, capacity * sizeof(uint32_t));
+    if (slots != NULL) {
+      runs->slots = slots;
+      runs->capacity = capacity;
+    }
+  }
+  if (runs->count < runs->capacity) {
+    runs->slots[runs->count++] = slot;
+  }
+  pthread_mutex_unlock(&spill.lock);
+}
+
+static int write_all(const char *bytes, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(spill.fd, bytes, len, offset);
+    if (n < 0 && errno != EINTR) {
+      return errno;
+    }
+    if (n > 0) {
+      bytes += n;
+      len -= (size_t)n;
+      offset += n;
+    }
+  }
+  return 0;
+}
+
+extent *spill_extent(const extent *e) {
+  // Only the packing thread spills, one buffer will do
+  static char buffer[EXTENT_MAX_SIZE];
+
+  if (e->spilled != 0 || e->len < SPILL_MIN_SIZE) {
+    return NULL;
+  }
+
+  // Plain bytes are compressed on the way out if that saves an eighth, like
+  // pack_extent does, there is less to write and to read back
+  const char *bytes = e->bytes;
+  size_t packed = e->packed;
+  if (packed == 0) {
+    size_t limit = e->len - e->len / 8;
+    packed = lz_compress(e->bytes, e->len, buffer,
+                         limit < sizeof(buffer) ? limit : sizeof(buffer));
+    bytes = packed != 0 ? buffer : e->bytes;
+  }
+  size_t size = packed != 0 ? packed : e->len;
+
+  size_t length = run_length(size);
+  uint32_t slot = take_run(length);
+  if (slot == UINT32_MAX) {
+    return NULL;
+  }
+  extent *spilled = new_extent(0);
+  if (spilled == NULL ||
+      write_all(bytes, size, (off_t)slot * SPILL_SLOT_SIZE) != 0) {
+    free(spilled);
+    give_run(slot, length);
+    return NULL;
+  }
+  spilled->len = e->len;
+  spilled->capacity = e->len;
+  spilled->packed = (uint32_t)packed;
+  spilled->spilled = slot + 1;
+  stat_add(STAT_EXTENTS_SPILLED, 1);
+  stat_add(STAT_SPILLED_BYTES, length * SPILL_SLOT_SIZE);
+  return spilled;
+}
+
+void spill_read(const extent *e, char *dest) {
+  size_t len = stored_size(e);
+  off_t offset = (off_t)(e->spilled - 1) * SPILL_SLOT_SIZE;
+  while (len > 0) {
+    ssize_t n = pread(spill.fd, dest, len, offset);
+    if (n == 0 || (n < 0 && errno != EINTR)) {
+      exit(EIO);
+    }
+    if (n > 0) {
+      dest += n;
+      len -= (size_t)n;
+      offset += n;
+    }
+  }
+}
+
+void spill_forget(extent *e) {
+  size_t length = run_length(stored_size(e));
+  give_run(e->spilled - 1, length);
+  stat_add(STAT_SPILLED_BYTES, -(uint64_t)(length * SPILL_SLOT_SIZE));
+}
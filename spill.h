@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file.h"
+
+#define SPILL_SLOT_SIZE 512 // Spill file space is handed out in these
+#define SPILL_MIN_SIZE SPILL_SLOT_SIZE // Smaller extents stay in memory
+
+// A memory budget for file contents, and a spill file the contents of the
+// files used least recently go to when they outgrow it.
+//
+// Off unless spill_start was called. Memory is then counted as extents are
+// allocated and freed, and once more than the budget is in use the packing
+// thread is woken up. It ranks regular files by when their contents were
+// last used, the way it tells idle ones apart, and moves the extents of the
+// coldest ones to the spill file until an eighth of the budget is free
+// again. Directories, inodes and extent tables stay in memory, so paths
+// resolve as fast as ever however much was spilled.
+//
+// A spilled extent keeps its len and capacity, and packed if its bytes were
+// compressed on the way out, but holds no bytes: they are at slot spilled - 1
+// of the file. Readers go through unpack_extent like for packed extents, so
+// the last few stay in memory, and writers copy them, which brings the part
+// of the file they change back. Snapshot extents are left alone, the kernel
+// pages those out from the image by itself.
+
+extern bool spill_enabled;
+extern uint64_t spill_resident; // Bytes of extents in memory
+
+// Wake the packing thread if resident is over the budget
+void spill_check(uint64_t resident);
+
+// Called as extents are allocated and freed, with the negated amount for
+// the latter
+static inline void spill_account(uint64_t bytes) {
+  if (__builtin_expect(spill_enabled, 0)) {
+    spill_check(__atomic_add_fetch(&spill_resident, bytes, __ATOMIC_RELAXED));
+  }
+}
+
+// Keep file contents within budget bytes, spilling to an unlinked file in
+// dir. Call before any file is written. The file goes with the process.
+int spill_start(size_t budget, const char *dir);
+
+// How many bytes over the budget should be spilled to be comfortably under
+// it again, 0 if none
+size_t spill_excess(void);
+// Called by the packing thread once it got back under the budget, later
+// allocations over it wake it again
+void spill_relieved(void);
+
+// A spilled copy of e, or NULL if it is spilled already or the spill file
+// could not take it
+extent *spill_extent(const extent *e);
+
+// The packed or, if e is not packed, len bytes that were spilled, into dest
+void spill_read(const extent *e, char *dest);
+
+// Called by put_extent once the last reference to a spilled extent is gone
+void spill_forget(extent *e);
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "io.h"
+#include "stats.h"
+
+// Log-linear buckets, like HDR histograms: values below 16 have one each,
+// every power of two above is split in 16, which keeps any value within
+// 1/16 of its bucket over the whole 64 bit range
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((65 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS)
+
+static const char *command_names[] = {
+    "cd",         "ls",         "cat",        "find",       "touch",
+    "echo",       "mkdir",      "mv",         "cp",         "rm",
+    "ln",         "save",       "load",       "checkpoint", "exit",
+    "stats",      "open",       "read",       "write",      "append",
+    "close",      "pread",      "pwrite",     "truncate",   "ftruncate",
+    "other"};
+#define STAT_COMMANDS (sizeof(command_names) / sizeof(command_names[0]))
+
+static const char *counter_names[STAT_COUNTERS] = {
+    [STAT_RESOLVE_CALLS] = "resolve_path_calls",
+    [STAT_RESOLVE_CACHED] = "resolve_path_cached",
+    [STAT_LOCK_PATH_CALLS] = "lock_path_calls",
+    [STAT_COMPONENTS] = "path_components",
+    [STAT_DIR_REBUILDS] = "dir_rebuilds",
+    [STAT_DIR_SORTS] = "dir_sorts",
+    [STAT_APPEND_BYTES] = "append_bytes",
+    [STAT_EXTENT_BYTES] = "extent_bytes_allocated",
+    [STAT_EXTENT_TABLE_BYTES] = "extent_table_bytes_allocated",
+    [STAT_INODE_ALLOCS] = "inode_allocs",
+    [STAT_INODE_FREES] = "inode_frees",
+    [STAT_RELEASES_DEFERRED] = "releases_deferred",
+    [STAT_DEDUP_HITS] = "dedup_hits",
+    [STAT_EXTENTS_PACKED] = "extents_packed",
+    [STAT_EXTENTS_UNPACKED] = "extents_unpacked",
+    [STAT_EXTENTS_SPILLED] = "extents_spilled",
+    [STAT_LOGICAL_BYTES] = "logical_bytes",
+    [STAT_PHYSICAL_BYTES] = "physical_bytes",
+    [STAT_SPILLED_BYTES] = "spilled_bytes",
+};
+
+typedef struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram;
+
+// One per thread that counted anything, written only by that thread and
+// kept after it ends. Latencies are only kept by threads that run commands,
+// so the histograms come separately.
+typedef struct stats_block {
+  uint64_t counters[STAT_COUNTERS];
+  histogram *commands;
+  struct stats_block *next;
+} stats_block;
+
+bool stats_enabled = false;
+
+static stats_block *blocks = NULL;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local stats_block *self = NULL;
+
+void stats_enable(void) { stats_enabled = true; }
+
+static stats_block *get_block(void) {
+  if (self != NULL) {
+    return self;
+  }
+  stats_block *b = calloc(1, sizeof(stats_block));
+  if (b == NULL) {
+    exit(ENOMEM);
+  }
+  pthread_mutex_lock(&blocks_lock);
+  b->next = blocks;
+  blocks = b;
+  pthread_mutex_unlock(&blocks_lock);
+  self = b;
+  return b;
+}
+
+// Only the owner writes, the stores just have to be whole for stats_print
+static void bump(uint64_t *value, uint64_t n) {
+  __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+void stats_count(stat_counter counter, uint64_t n) {
+  bump(&get_block()->counters[counter], n);
+}
+
+int stats_command(const char *line) {
+  line += strspn(line, " \n");
+  size_t len = strcspn(line, " \n");
+  for (size_t i = 0; i + 1 < STAT_COMMANDS; i++) {
+    if (strlen(command_names[i]) == len &&
+        strncmp(line, command_names[i], len) == 0) {
+      return (int)i;
+    }
+  }
+  return (int)STAT_COMMANDS - 1;
+}
+
+const char *stats_command_name(int command) {
+  return command_names[command];
+}
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t bucket_of(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return (size_t)value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  return (size_t)(exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+         ((value >> (exponent - HISTOGRAM_SUB_BITS)) &
+          (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls in a bucket
+static uint64_t bucket_top(size_t bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+  int exponent =
+      (int)(bucket / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BITS - 1;
+  uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+  return ((HISTOGRAM_SUB_BUCKETS + sub + 1)
+          << (exponent - HISTOGRAM_SUB_BITS)) -
+         1;
+}
+
+void stats_time(int command, uint64_t ns) {
+  stats_block *b = get_block();
+  if (b->commands == NULL) {
+    histogram *commands = calloc(STAT_COMMANDS, sizeof(histogram));
+    if (commands == NULL) {
+      exit(ENOMEM);
+    }
+    __atomic_store_n(&b->commands, commands, __ATOMIC_RELEASE);
+  }
+
+  histogram *h = &b->commands[command];
+  bump(&h->count, 1);
+  bump(&h->sum, ns);
+  if (ns > h->max) {
+    __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+  }
+  bump(&h->buckets[bucket_of(ns)], 1);
+}
+
+// Smallest value at least a fraction of the samples are at or below
+static uint64_t percentile(const histogram *h, double fraction) {
+  uint64_t rank = (uint64_t)(fraction * (double)h->count + 0.999999);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t top = bucket_top(i);
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
+
+static uint64_t load(const uint64_t *value) {
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+void stats_print(void) {
+  if (!stats_enabled) {
+    out_printf("stats: not enabled, start with -S\n");
+    return;
+  }
+
+  // Totals over every thread, as of some moment while they kept counting
+  uint64_t counters[STAT_COUNTERS] = {0};
+  histogram *commands = calloc(STAT_COMMANDS, sizeof(histogram));
+  if (commands == NULL) {
+    exit(ENOMEM);
+  }
+  pthread_mutex_lock(&blocks_lock);
+  for (stats_block *b = blocks; b != NULL; b = b->next) {
+    for (size_t i = 0; i < STAT_COUNTERS; i++) {
+      counters[i] += load(&b->counters[i]);
+    }
+    histogram *theirs = __atomic_load_n(&b->commands, __ATOMIC_ACQUIRE);
+    for (size_t c = 0; theirs != NULL && c < STAT_COMMANDS; c++) {
+      commands[c].count += load(&theirs[c].count);
+      commands[c].sum += load(&theirs[c].sum);
+      uint64_t max = load(&theirs[c].max);
+      if (max > commands[c].max) {
+        commands[c].max = max;
+      }
+      for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        commands[c].buckets[i] += load(&theirs[c].buckets[i]);
+      }
+    }
+  }
+  pthread_mutex_unlock(&blocks_lock);
+
+  out_printf("%-10s %10s %10s %10s %10s %10s %10s %10s\n", "command", "count",
+             "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+  for (size_t c = 0; c < STAT_COMMANDS; c++) {
+    const histogram *h = &commands[c];
+    if (h->count == 0) {
+      continue;
+    }
+    out_printf("%-10s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+               command_names[c], (unsigned long long)h->count,
+               (double)h->sum / (double)h->count / 1e3,
+               percentile(h, 0.5) / 1e3, percentile(h, 0.9) / 1e3,
+               percentile(h, 0.99) / 1e3, percentile(h, 0.999) / 1e3,
+               h->max / 1e3);
+  }
+  for (size_t i = 0; i < STAT_COUNTERS; i++) {
+    out_printf("%-28s %llu\n", counter_names[i],
+               (unsigned long long)counters[i]);
+  }
+  free(commands);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Counters of what the filesystem does internally, and a latency histogram
+// per command, dumped by the stats command.
+//
+// Everything is off unless stats_enable was called, at the cost of one
+// predictable branch per counter. When on, each thread counts into a block
+// of its own, which only it writes, so counting takes no lock and no atomic
+// read-modify-write. stats_print adds the blocks up.
+
+typedef enum stat_counter {
+  STAT_RESOLVE_CALLS,      // resolve_path
+  STAT_RESOLVE_CACHED,     // of which answered by the dcache
+  STAT_LOCK_PATH_CALLS,    // lock_path
+  STAT_COMPONENTS,         // Path components looked up by either
+  STAT_DIR_REBUILDS,       // Directory tables grown, compacted or sorted
+  STAT_DIR_SORTS,          // of which sorted, with qsort
+  STAT_APPEND_BYTES,       // Bytes appended to files
+  STAT_EXTENT_BYTES,       // Bytes of extents allocated
+  STAT_EXTENT_TABLE_BYTES, // Bytes of extent tables replaced by bigger ones
+  STAT_INODE_ALLOCS,
+  STAT_INODE_FREES,
+  STAT_RELEASES_DEFERRED,  // Unlinked subtrees left to the reaper
+  STAT_DEDUP_HITS,         // Blocks written that the dedup store already had
+  STAT_EXTENTS_PACKED,     // Compressed by the packing thread
+  STAT_EXTENTS_UNPACKED,   // Made plain for readers, cached ones not counted
+  STAT_EXTENTS_SPILLED,    // Moved to the spill file by the packing thread
+  // Gauges rather than counters, taken from by adding the negated amount
+  STAT_LOGICAL_BYTES,      // Sizes of all regular files
+  STAT_PHYSICAL_BYTES,     // Memory their contents take, snapshots included
+  STAT_SPILLED_BYTES,      // Spill file space their contents take
+  STAT_COUNTERS
+} stat_counter;
+
+extern bool stats_enabled;
+
+void stats_enable(void);
+void stats_count(stat_counter counter, uint64_t n);
+
+static inline void stat_add(stat_counter counter, uint64_t n) {
+  if (__builtin_expect(stats_enabled, 0)) {
+    stats_count(counter, n);
+  }
+}
+
+// Commands are told apart by name, see stats_command. Any other name is
+// counted as "other".
+int stats_command(const char *line);
+const char *stats_command_name(int command);
+void stats_time(int command, uint64_t ns);
+uint64_t stats_now(void);
+
+void stats_print(void);
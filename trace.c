@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_RING_SIZE 32768 // Events kept per thread, a power of two
+#define TRACE_DETAIL_SIZE 47  // Rounds an event up to a cache line
+
+typedef struct trace_event {
+  uint64_t ns;
+  const char *name;
+  char phase;
+  char detail[TRACE_DETAIL_SIZE];
+} trace_event;
+
+// One per thread that recorded anything, kept after it ends. Only the owner
+// writes, head is moved past an event once it is complete.
+typedef struct trace_ring {
+  trace_event *events;
+  uint64_t head;
+  unsigned tid;
+  struct trace_ring *next;
+} trace_ring;
+
+bool trace_enabled = false;
+
+static FILE *trace_file = NULL;
+static uint64_t trace_epoch = 0; // Timestamps are relative to trace_start
+static trace_ring *rings = NULL;
+static unsigned ring_count = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local trace_ring *self = NULL;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static trace_ring *get_ring(void) {
+  if (self != NULL) {
+    return self;
+  }
+  trace_ring *r = calloc(1, sizeof(trace_ring));
+  if (r == NULL ||
+      (r->events = malloc(TRACE_RING_SIZE * sizeof(trace_event))) == NULL) {
+    exit(ENOMEM);
+  }
+  pthread_mutex_lock(&rings_lock);
+  r->tid = ++ring_count;
+  r->next = rings;
+  rings = r;
+  pthread_mutex_unlock(&rings_lock);
+  self = r;
+  return r;
+}
+
+// The file is opened right away, so a bad path is known before any work
+int trace_start(const char *path) {
+  trace_file = fopen(path, "w");
+  if (trace_file == NULL) {
+    return errno;
+  }
+  trace_epoch = now_ns();
+  trace_enabled = true;
+  return 0;
+}
+
+void trace_record(char phase, const char *name, const char *detail,
+                  size_t max) {
+  trace_ring *r = get_ring();
+  trace_event *e = &r->events[r->head & (TRACE_RING_SIZE - 1)];
+  e->ns = now_ns();
+  e->name = name;
+  e->phase = phase;
+  e->detail[0] = '\0';
+  if (detail != NULL) {
+    // The end of a long path tells more about it than the start
+    size_t len = 0;
+    while (len < max && detail[len] != '\0' && detail[len] != '\n') {
+      len++;
+    }
+    size_t skip = 0;
+    if (len >= TRACE_DETAIL_SIZE) {
+      skip = len - (TRACE_DETAIL_SIZE - 4);
+      memcpy(e->detail, "...", 3);
+    }
+    memcpy(e->detail + (skip > 0 ? 3 : 0), detail + skip, len - skip);
+    e->detail[(skip > 0 ? 3 : 0) + len - skip] = '\0';
+  }
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+// JSON string contents, paths may hold anything
+static void write_escaped(FILE *out, const char *str) {
+  for (; *str != '\0'; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+}
+
+static void write_ring(FILE *out, const trace_ring *r, bool *first) {
+  uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  int pid = (int)getpid();
+
+  // Ends of spans whose beginning was overwritten would close the wrong ones
+  unsigned depth = 0;
+  for (uint64_t i = start; i < head; i++) {
+    const trace_event *e = &r->events[i & (TRACE_RING_SIZE - 1)];
+    if (e->phase == 'E') {
+      if (depth == 0) {
+        continue;
+      }
+      depth--;
+    } else {
+      depth++;
+    }
+
+    fprintf(out, "%s\n{\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f",
+            *first ? "" : ",", e->phase, pid, r->tid,
+            (double)(e->ns - trace_epoch) / 1e3);
+    if (e->phase == 'B') {
+      fprintf(out, ",\"name\":\"");
+      write_escaped(out, e->name);
+      fprintf(out, "\"");
+      if (e->detail[0] != '\0') {
+        fprintf(out, ",\"args\":{\"detail\":\"");
+        write_escaped(out, e->detail);
+        fprintf(out, "\"}");
+      }
+    }
+    fprintf(out, "}");
+    *first = false;
+  }
+}
+
+int trace_stop(void) {
+  if (!trace_enabled) {
+    return 0;
+  }
+  trace_enabled = false;
+
+  FILE *out = trace_file;
+  trace_file = NULL;
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  bool first = true;
+  pthread_mutex_lock(&rings_lock);
+  for (trace_ring *r = rings; r != NULL; r = r->next) {
+    write_ring(out, r, &first);
+  }
+  pthread_mutex_unlock(&rings_lock);
+  fprintf(out, "\n]}\n");
+
+  if (fclose(out) != 0) {
+    return errno;
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Begin and end events of commands and of the fs calls they make, written
+// out as Chrome trace JSON (chrome://tracing, Perfetto) to see where one
+// command spends its time and which lookups it repeats.
+//
+// Off unless trace_start was called, at the cost of one predictable branch
+// per span. When on, each thread records into a ring of its own that only
+// it writes, so recording takes no lock. A full ring overwrites its oldest
+// events, the trace then starts later on that thread.
+
+extern bool trace_enabled;
+
+// Spans are recorded from trace_start on, trace_stop writes them to path.
+// Threads still recording meanwhile may lose their last events.
+int trace_start(const char *path);
+int trace_stop(void);
+
+// name must stay valid until the trace is written. detail is copied up to
+// its first newline or its first max bytes, keeping its end if it is too
+// long, and may be NULL.
+void trace_record(char phase, const char *name, const char *detail,
+                  size_t max);
+
+static inline bool trace_open(const char *name, const char *detail,
+                              size_t len) {
+  if (__builtin_expect(trace_enabled, 0)) {
+    trace_record('B', name, detail, len);
+    return true;
+  }
+  return false;
+}
+
+static inline void trace_close(bool *open) {
+  if (*open) {
+    trace_record('E', NULL, NULL, 0);
+  }
+}
+
+// Open a span that ends when the enclosing block is left, whichever way
+#define TRACE_SPAN(name, detail) TRACE_SPAN_N(name, detail, (size_t)-1)
+// Same, for a detail that is not NUL terminated
+#define TRACE_SPAN_N(name, detail, len)                                       \
+  __attribute__((cleanup(trace_close))) bool trace_span =                    \
+      trace_open(name, detail, len)
@@ -1,87 +1,318 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "dir.h"
+#include "epoch.h"
+#include "file.h"
 #include "fs.h"
+#include "io.h"
+#include "pack.h"
+#include "pool.h"
 #include "util.h"
 
 int compare_entries(const void *a, const void *b) {
   return strcmp(((DIR_ENTRY *)a)->name, ((DIR_ENTRY *)b)->name);
 }
 
+// Listings and cat take no lock, they print whatever table or contents were
+// published when they got there
 void list_dir(inode *dir) { // Used for printing directories
-  qsort(dir->data + (sizeof(DIR_ENTRY) * 2),
-        dir->data_size / sizeof(DIR_ENTRY) - 2, sizeof(DIR_ENTRY),
-        compare_entries);
+  if (dir->filetype != S_IFDIR) {
+    return;
+  }
 
-  for (size_t i = 2; i < dir->data_size / sizeof(DIR_ENTRY); i++) {
-    printf("%s\n", ((DIR_ENTRY *)dir->data)[i].name);
+  epoch_enter();
+  sort_dir(dir);
+  directory *d = dir_table(dir);
+  for (size_t i = 2; i < dir_used(d); i++) {
+    if (dir_item(&d->entries[i]) != NULL) {
+      out_str(d->entries[i].name);
+      out_char('\n');
+    }
   }
+  epoch_exit();
 
   return;
 }
 
-void read_file(inode *file) {
-  if (file->data_size > 0) {
-    printf("%s\n", (char *)file->data);
+void read_file(inode *file) { read_range(file, 0, SIZE_MAX); }
+
+// Stream the extents as they are, no need to flatten them first. Extents
+// before offset are only looked at for their length.
+void read_range(inode *file, size_t offset, size_t len) {
+  if (file->filetype != S_IFREG) {
+    return;
+  }
+
+  epoch_enter();
+  pack_touch(file);
+  file_data *f = __atomic_load_n(&file->data, __ATOMIC_ACQUIRE);
+  if (f != NULL) {
+    size_t count = __atomic_load_n(&f->count, __ATOMIC_ACQUIRE);
+    extent **extents = __atomic_load_n(&f->extents, __ATOMIC_ACQUIRE);
+    size_t start = 0;
+    for (size_t i = file_extent_at(extents, count, offset, &start);
+         i < count && len > 0; i++) {
+      extent *e = __atomic_load_n(&extents[i], __ATOMIC_ACQUIRE);
+      size_t e_len = __atomic_load_n(&e->len, __ATOMIC_ACQUIRE);
+      size_t at = offset > start ? offset - start : 0;
+      if (at < e_len) {
+        size_t chunk = e_len - at < len ? e_len - at : len;
+        if (!extent_plain(e)) {
+          extent *plain = unpack_extent(e);
+          out_write(plain->bytes + at, chunk);
+          put_extent(plain);
+        } else {
+          out_write(e->bytes + at, chunk);
+        }
+        len -= chunk;
+      }
+      start += e_len;
+    }
+    out_char('\n');
+  }
+  epoch_exit();
+}
+
+// One directory being listed by recursive_list
+typedef struct find_frame {
+  directory *table; // As it was when the walk entered the directory
+  size_t next;      // Next entry position to visit
+  size_t path_len; // Length of the directory's path in the path buffer
+} find_frame;
+
+struct find_task;
+
+// Where the lines of a subtree handed to another worker go in the output
+typedef struct find_splice {
+  size_t offset;
+  struct find_task *task;
+} find_splice;
+
+// Lines of one subtree listed by a worker, kept until everything is done so
+// they come out in the same order as a serial walk would print them
+typedef struct find_task {
+  inode *dir;
+  char *prefix; // Path of dir
+  size_t prefix_len;
+  char *out;
+  size_t len;
+  size_t capacity;
+  find_splice *splices;
+  size_t splice_count;
+  size_t splice_capacity;
+} find_task;
+
+// Depth first walk on an explicit stack, so deep trees cannot overflow the C
+// stack. Every path is built in one buffer: entering a directory appends its
+// name, leaving it just moves the end back.
+typedef struct find_walk {
+  find_frame *stack;
+  size_t stack_capacity;
+  char *path;
+  size_t path_capacity;
+  find_task *task; // Collects the lines, NULL writes them to the output sink
+} find_walk;
+
+// Kept between calls, so repeated serial finds do not allocate at all
+static _Thread_local find_walk serial_walk;
+
+// Grow buffer geometrically to hold at least count items of size bytes
+static void *reserve(void *buffer, size_t *capacity, size_t count,
+                     size_t size) {
+  if (count <= *capacity) {
+    return buffer;
+  }
+  size_t new_capacity = *capacity == 0 ? 16 : *capacity;
+  while (new_capacity < count) {
+    new_capacity *= 2;
+  }
+  buffer = realloc(buffer, new_capacity * size);
+  if (buffer == NULL) {
+    exit(ENOMEM);
+  }
+  *capacity = new_capacity;
+  return buffer;
+}
+
+// Print the path currently in the buffer as one line
+static void emit_path(find_walk *walk, size_t len) {
+  walk->path[len] = '\n';
+  if (walk->task == NULL) {
+    out_write(walk->path, len + 1);
     return;
   }
+
+  find_task *task = walk->task;
+  task->out = reserve(task->out, &task->capacity, task->len + len + 1, 1);
+  memcpy(task->out + task->len, walk->path, len + 1);
+  task->len += len + 1;
 }
 
-void recursive_list(inode *dir, char *prefix) {
-  qsort(dir->data + (sizeof(DIR_ENTRY) * 2),
-        dir->data_size / sizeof(DIR_ENTRY) - 2, sizeof(DIR_ENTRY),
-        compare_entries);
+static void enter_dir(find_walk *walk, size_t depth, inode *dir,
+                      size_t path_len) {
+  walk->stack = reserve(walk->stack, &walk->stack_capacity, depth + 1,
+                        sizeof(find_frame));
+  sort_dir(dir);
+  directory *table = dir->filetype == S_IFDIR ? dir_table(dir) : NULL;
+  walk->stack[depth] = (find_frame){table, 2, path_len};
+
+  emit_path(walk, path_len);
+}
+
+static void find_task_run(void *arg);
+
+// Hand a subdirectory whose path is in the buffer to another worker
+static void split_dir(find_walk *walk, inode *dir, size_t path_len) {
+  find_task *child = calloc(1, sizeof(find_task));
+  char *prefix = malloc(path_len + 1);
+  if (child == NULL || prefix == NULL) {
+    exit(ENOMEM);
+  }
+  memcpy(prefix, walk->path, path_len);
+  child->dir = dir;
+  child->prefix = prefix;
+  child->prefix_len = path_len;
 
-  printf("%s\n", prefix);
+  find_task *task = walk->task;
+  task->splices = reserve(task->splices, &task->splice_capacity,
+                          task->splice_count + 1, sizeof(find_splice));
+  task->splices[task->splice_count++] = (find_splice){task->len, child};
 
-  for (size_t i = 2; i < dir->data_size / sizeof(DIR_ENTRY); i++) {
-    if (((DIR_ENTRY *)dir->data)[i].item->filetype == S_IFDIR) {
-      char *p_asdir = append(prefix, "/");
-      char *new_pre = append(p_asdir, ((DIR_ENTRY *)dir->data)[i].name);
-      recursive_list(((DIR_ENTRY *)dir->data)[i].item, new_pre);
-      free(p_asdir);
-      free(new_pre);
+  pool_spawn(find_task_run, child);
+}
+
+// Runs inside an epoch section and takes no lock, every directory is listed
+// from the table it had when the walk got to it
+static void walk_tree(find_walk *walk, inode *dir, size_t path_len) {
+  size_t depth = 0;
+  enter_dir(walk, depth++, dir, path_len);
+
+  while (depth > 0) {
+    find_frame *frame = &walk->stack[depth - 1];
+    if (frame->next >= dir_used(frame->table)) {
+      depth--;
+      continue;
+    }
+
+    DIR_ENTRY *entry = &frame->table->entries[frame->next++];
+    inode *item = dir_item(entry);
+    if (item == NULL) {
+      continue;
+    }
+    size_t name_len = strlen(entry->name);
+    path_len = frame->path_len + 1 + name_len;
+    walk->path = reserve(walk->path, &walk->path_capacity, path_len + 1, 1);
+    walk->path[frame->path_len] = '/';
+    memcpy(walk->path + frame->path_len + 1, entry->name, name_len);
+
+    if (item->filetype != S_IFDIR) {
+      emit_path(walk, path_len);
+    } else if (walk->task != NULL && pool_wants_work()) {
+      split_dir(walk, item, path_len);
     } else {
-      printf("%s/%s\n", prefix, ((DIR_ENTRY *)dir->data)[i].name);
+      enter_dir(walk, depth++, item, path_len);
     }
   }
+}
 
-  return;
+static void find_top_task(void *arg) {
+  find_walk walk = {.task = arg};
+  find_task *task = arg;
+
+  walk.path = reserve(walk.path, &walk.path_capacity, task->prefix_len + 1, 1);
+  memcpy(walk.path, task->prefix, task->prefix_len);
+  walk_tree(&walk, task->dir, task->prefix_len);
+
+  free(walk.stack);
+  free(walk.path);
 }
 
-void move(const char *src, const char *dst) {
-  inode *src_inode;
-  int err = resolve_path(src, &src_inode);
-  if (err != 0) {
-    clear_fs();
-    exit(-1);
-  }
+// Split off subtrees are kept allocated by the section recursive_list holds
+// until every task is done, the worker enters its own to read them
+static void find_task_run(void *arg) {
+  epoch_enter();
+  find_top_task(arg);
+  epoch_exit();
+}
+
+// Print the lines of a task with those of its subtasks spliced in, on an
+// explicit stack as well since splits can nest as deep as the tree
+static void flush_tasks(find_task *root) {
+  typedef struct flush_frame {
+    find_task *task;
+    size_t splice; // Next splice to follow
+    size_t offset; // Lines before this were printed already
+  } flush_frame;
 
-  char *src_parent = parent_of(src);
-  char *src_name = filename(src);
+  flush_frame *stack = NULL;
+  size_t capacity = 0;
+  size_t depth = 0;
+  stack = reserve(stack, &capacity, 1, sizeof(flush_frame));
+  stack[depth++] = (flush_frame){root, 0, 0};
 
-  err = remove_entry(src_parent, src_name);
-  if (err != 0) {
-    clear_fs();
-    exit(-1);
+  while (depth > 0) {
+    flush_frame *frame = &stack[depth - 1];
+    find_task *task = frame->task;
+
+    if (frame->splice < task->splice_count) {
+      find_splice *splice = &task->splices[frame->splice++];
+      out_write(task->out + frame->offset, splice->offset - frame->offset);
+      frame->offset = splice->offset;
+      stack = reserve(stack, &capacity, depth + 1, sizeof(flush_frame));
+      stack[depth++] = (flush_frame){splice->task, 0, 0};
+      continue;
+    }
+
+    out_write(task->out + frame->offset, task->len - frame->offset);
+    free(task->prefix);
+    free(task->out);
+    free(task->splices);
+    free(task);
+    depth--;
   }
 
-  char *dst_parent = parent_of(dst);
-  char *dst_name = filename(dst);
+  free(stack);
+}
 
-  err = add_entry(dst_parent, dst_name, src_inode);
-  if (err != 0) {
-    clear_fs();
-    exit(-1);
+// Subdirectories are split among the pool's workers while some of them are
+// idle, a pool of one thread walks straight into the output sink
+void recursive_list(inode *dir, const char *prefix) {
+  size_t len = strlen(prefix);
+  epoch_enter();
+
+  if (pool_threads() <= 1) {
+    serial_walk.path =
+        reserve(serial_walk.path, &serial_walk.path_capacity, len + 1, 1);
+    memcpy(serial_walk.path, prefix, len);
+    walk_tree(&serial_walk, dir, len);
+    epoch_exit();
+    return;
   }
 
-  free(src_parent);
-  free(dst_parent);
-  return;
+  find_task *root = calloc(1, sizeof(find_task));
+  char *root_prefix = malloc(len + 1);
+  if (root == NULL || root_prefix == NULL) {
+    exit(ENOMEM);
+  }
+  memcpy(root_prefix, prefix, len);
+  root->dir = dir;
+  root->prefix = root_prefix;
+  root->prefix_len = len;
+
+  pool_run(find_top_task, root);
+  epoch_exit();
+  flush_tasks(root);
+}
+
+int move(_fs *fs, const char *src, const char *dst) {
+  return move_entry(fs, src, dst);
 }
 
-void parse_echo(char *line) {
+void parse_echo(_fs *fs, char *line) {
   int end_data = 0;
 
   char *w_ptr = line; // Line should begin on a "
@@ -107,13 +338,18 @@ void parse_echo(char *line) {
   memcpy(data, line, end_data);
   data[end_data] = '\0';
 
-  w_ptr = strtok(w_ptr, " \n");
-  create_file(w_ptr);
+  char *save_ptr = NULL;
+  w_ptr = strtok_r(w_ptr, " \n", &save_ptr);
+  if (w_ptr == NULL) {
+    free(data);
+    return;
+  }
+  create_file(fs, w_ptr);
 
   if (redir_sign_count == 1) {
-    write_file(w_ptr, data);
+    write_file(fs, w_ptr, data, (size_t)end_data);
   } else {
-    append_file(w_ptr, data);
+    append_file(fs, w_ptr, data, (size_t)end_data);
   }
 
   free(data);
@@ -5,10 +5,12 @@
 
 void list_dir(inode *dir);
 void read_file(inode *file);
-void recursive_list(inode *dir, char *prefix);
+// Print len bytes of a file from offset on, as many as there are
+void read_range(inode *file, size_t offset, size_t len);
+void recursive_list(inode *dir, const char *prefix);
 
-void move(const char *src, const char *dst);
+int move(_fs *fs, const char *src, const char *dst);
 
-void parse_echo(char *line);
+void parse_echo(_fs *fs, char *line);
 
 int compare_entries(const void *a, const void *b);